@@ -0,0 +1,445 @@
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memorypool.h"
+
+/*
+ *  基准测试: 同一次运行中对比内存池与系统malloc
+ *  每个 (负载, 线程数, 分配器) 组合在单独fork出的子进程中运行, 峰值RSS互不影响
+ *  用法: ./bench.out [最大线程数] [每线程操作数] [负载名...]
+ */
+
+/* -------- 测试参数 -------- */
+#define POOL_MAX_SIZE (8 * GB)   // 内存池总上限
+#define POOL_SIZE (64 * MB)      // 每个内存块大小
+#define DEFAULT_OPS (1000000)    // 每线程操作数
+#define SAMPLE_MASK (7)          // 每8次操作记录一次延迟, 减小计时本身的影响
+#define QUEUE_SIZE (4096)        // 生产者消费者队列长度
+/* -------- 测试参数 -------- */
+
+/*
+ *  分配器
+ */
+
+static MemoryPool* g_mp = NULL;
+
+static void* pool_alloc(size_t sz) { return MemoryPoolAlloc(g_mp, sz); }
+static void* pool_realloc(void* p, size_t sz) { return MemoryPoolRealloc(g_mp, p, sz); }
+static void pool_free(void* p) { MemoryPoolFree(g_mp, p); }
+
+struct Allocator {
+    const char* name;
+    void* (*alloc)(size_t);
+    void* (*realloc)(void*, size_t);
+    void (*free)(void*);
+    int policy;  // 内存池的分配策略, -1为系统malloc
+    int arenas;  // 内存池的分片数量, -1为与线程数相同
+    int defer_merge;
+};
+
+static const Allocator allocators[] = {
+    {"malloc", malloc, realloc, free, -1, 0, 0},
+    {"pool", pool_alloc, pool_realloc, pool_free, MP_POLICY_FIRST_FIT, 0, 0},
+    {"pool-bf", pool_alloc, pool_realloc, pool_free, MP_POLICY_BEST_FIT, 0, 0},
+    {"pool-ar", pool_alloc, pool_realloc, pool_free, MP_POLICY_FIRST_FIT, -1, 0},
+    {"pool-dm", pool_alloc, pool_realloc, pool_free, MP_POLICY_FIRST_FIT, 0, 1},
+};
+
+/*
+ *  延迟直方图: 小于8ns逐个计数, 之后每个2的幂区间分8档
+ */
+
+#define LAT_BUCKETS 512
+
+struct Histogram {
+    unsigned long long count[LAT_BUCKETS];
+};
+
+static inline int lat_bucket(unsigned long long ns) {
+    if (ns < 8) return (int) ns;
+    int e = 63 - __builtin_clzll(ns);
+    int b = (e - 2) * 8 + (int) ((ns >> (e - 3)) & 7);
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+static inline unsigned long long bucket_ns(int b) {
+    if (b < 8) return b;
+    return (unsigned long long) (8 + b % 8) << (b / 8 - 1);
+}
+
+static unsigned long long percentile(const Histogram* h, double q) {
+    unsigned long long total = 0, seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) total += h->count[i];
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen && seen >= total * q) return bucket_ns(i);
+    }
+    return 0;
+}
+
+static inline unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ *  线程上下文
+ */
+
+struct Queue;
+
+struct Thread {
+    const Allocator* a;
+    int id;
+    long ops;             // 本线程要执行的操作数
+    long done;            // 实际完成的操作数(分配/释放/realloc各算一次)
+    unsigned long long rng;
+    Histogram hist;
+    Queue* queue;         // 生产者消费者负载使用
+    int producer;
+    double frag;          // 0号线程在释放剩余块之前记录的碎片指数, -1为未记录
+};
+
+static inline unsigned int rnd(Thread* t) {
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    return (unsigned int) (t->rng >> 32);
+}
+
+// 计时执行一次操作
+#define TIMED(t, expr)                                               \
+    do {                                                             \
+        if (((t)->done & SAMPLE_MASK) == 0) {                        \
+            unsigned long long _t0 = now_ns();                       \
+            expr;                                                    \
+            (t)->hist.count[lat_bucket(now_ns() - _t0)]++;           \
+        } else {                                                     \
+            expr;                                                    \
+        }                                                            \
+        (t)->done++;                                                 \
+    } while (0)
+
+static inline void* checked(void* p) {
+    if (!p) {
+        printf("Memory overflow!\n");
+        exit(1);
+    }
+    return p;
+}
+
+// 写首尾字节, 模拟真实使用
+static inline void touch(void* p, size_t sz) {
+    ((char*) p)[0] = 1;
+    ((char*) p)[sz - 1] = 1;
+}
+
+// 0号线程在负载结束, 释放剩余块之前记录内存池的碎片指数
+static void snapshot(Thread* t) {
+    MemoryPoolFragInfo fi;
+    if (t->id == 0 && g_mp && !MemoryPoolGetFragInfo(g_mp, NULL, &fi)) t->frag = fi.frag_index;
+}
+
+/*
+ *  负载
+ */
+
+// 16~256字节均匀分布, 在固定大小的槽位中随机分配释放
+static void wl_uniform_small(Thread* t) {
+    const int slots = 1024;
+    void** p = (void**) calloc(slots, sizeof(void*));
+    while (t->done < t->ops) {
+        int i = rnd(t) % slots;
+        if (p[i]) {
+            TIMED(t, t->a->free(p[i]));
+            p[i] = NULL;
+        } else {
+            size_t sz = 16 + rnd(t) % 241;
+            TIMED(t, p[i] = checked(t->a->alloc(sz)));
+            touch(p[i], sz);
+        }
+    }
+    snapshot(t);
+    for (int i = 0; i < slots; i++)
+        if (p[i]) t->a->free(p[i]);
+    free(p);
+}
+
+// 幂律分布: 大部分是小块, 偶尔有大块(最大64KB)
+static inline size_t power_law_size(Thread* t) {
+    double u = (rnd(t) + 1.0) / 4294967297.0;
+    double sz = 16.0 / pow(u, 1 / 1.2);
+    return sz > 64 * KB ? 64 * KB : (size_t) sz;
+}
+
+static void wl_power_law(Thread* t) {
+    const int slots = 4096;
+    void** p = (void**) calloc(slots, sizeof(void*));
+    while (t->done < t->ops) {
+        int i = rnd(t) % slots;
+        if (p[i]) {
+            TIMED(t, t->a->free(p[i]));
+            p[i] = NULL;
+        } else {
+            size_t sz = power_law_size(t);
+            TIMED(t, p[i] = checked(t->a->alloc(sz)));
+            touch(p[i], sz);
+        }
+    }
+    snapshot(t);
+    for (int i = 0; i < slots; i++)
+        if (p[i]) t->a->free(p[i]);
+    free(p);
+}
+
+// 单生产者单消费者环形队列, 生产者分配, 消费者在另一个线程释放
+struct Queue {
+    void* slot[QUEUE_SIZE];
+    volatile unsigned long head __attribute__((aligned(64)));
+    volatile unsigned long tail __attribute__((aligned(64)));
+};
+
+static void wl_producer_consumer(Thread* t) {
+    Queue* q = t->queue;
+    long n = t->ops / 2;  // 每对线程共 ops 次分配与释放
+    if (t->producer) {
+        for (long k = 0; k < n; k++) {
+            size_t sz = 16 + rnd(t) % 1009;
+            void* p = NULL;
+            TIMED(t, p = checked(t->a->alloc(sz)));
+            touch(p, sz);
+            while (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == QUEUE_SIZE) sched_yield();
+            q->slot[q->tail % QUEUE_SIZE] = p;
+            __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+        }
+    } else {
+        for (long k = 0; k < n; k++) {
+            while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head) sched_yield();
+            void* p = q->slot[q->head % QUEUE_SIZE];
+            __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+            TIMED(t, t->a->free(p));
+        }
+    }
+}
+
+// 碎片化: 大小分布分阶段在小块与大块之间切换, 旧阶段留下的块打散free链表
+static void wl_churn(Thread* t) {
+    const int slots = 16384;
+    void** p = (void**) calloc(slots, sizeof(void*));
+    long phase_len = t->ops / 8 + 1;
+    while (t->done < t->ops) {
+        int i = rnd(t) % slots;
+        if (p[i]) {
+            TIMED(t, t->a->free(p[i]));
+            p[i] = NULL;
+        } else {
+            size_t sz = (t->done / phase_len) & 1 ? 512 + rnd(t) % 7680 : 16 + rnd(t) % 112;
+            TIMED(t, p[i] = checked(t->a->alloc(sz)));
+            touch(p[i], sz);
+        }
+    }
+    snapshot(t);
+    for (int i = 0; i < slots; i++)
+        if (p[i]) t->a->free(p[i]);
+    free(p);
+}
+
+// 缓冲区按1.5倍不断扩大直到256KB, 之后释放重新开始
+static void wl_realloc_growth(Thread* t) {
+    const int slots = 64;
+    void** p = (void**) calloc(slots, sizeof(void*));
+    size_t* sz = (size_t*) calloc(slots, sizeof(size_t));
+    while (t->done < t->ops) {
+        int i = rnd(t) % slots;
+        if (sz[i] >= 256 * KB) {
+            TIMED(t, t->a->free(p[i]));
+            p[i] = NULL;
+            sz[i] = 0;
+            continue;
+        }
+        size_t nsz = sz[i] ? sz[i] + sz[i] / 2 : 16 + rnd(t) % 48;
+        TIMED(t, p[i] = checked(t->a->realloc(p[i], nsz)));
+        touch(p[i], nsz);
+        sz[i] = nsz;
+    }
+    snapshot(t);
+    for (int i = 0; i < slots; i++)
+        if (p[i]) t->a->free(p[i]);
+    free(p);
+    free(sz);
+}
+
+struct Workload {
+    const char* name;
+    void (*fn)(Thread*);
+    int paired;  // 线程成对运行(生产者, 消费者)
+};
+
+static const Workload workloads[] = {
+    {"uniform_small", wl_uniform_small, 0},
+    {"power_law", wl_power_law, 0},
+    {"producer_consumer", wl_producer_consumer, 1},
+    {"churn", wl_churn, 0},
+    {"realloc_growth", wl_realloc_growth, 0},
+};
+
+/*
+ *  运行
+ */
+
+struct Result {
+    long ops;
+    double secs;
+    unsigned long long p50, p99, p999;
+    long rss_kb;
+    double frag;
+};
+
+static const Workload* g_wl = NULL;
+static pthread_barrier_t g_barrier;
+
+static void* thread_fn(void* arg) {
+    Thread* t = (Thread*) arg;
+    pthread_barrier_wait(&g_barrier);
+    g_wl->fn(t);
+    return NULL;
+}
+
+// 子进程中运行一次, 结果写入管道
+static void run_child(const Workload* wl, const Allocator* a, int nthreads, long ops, int fd) {
+    if (a->policy >= 0) {
+        MemoryPoolOptions opt;
+        memset(&opt, 0, sizeof(opt));
+        opt.max_mempool_size = POOL_MAX_SIZE;
+        opt.mempool_size = POOL_SIZE;
+        opt.policy = a->policy;
+        opt.arenas = a->arenas < 0 ? nthreads : a->arenas;
+        opt.defer_merge = a->defer_merge;
+        g_mp = MemoryPoolInitEx(&opt);
+        if (!g_mp) exit(1);
+    }
+    g_wl = wl;
+
+    Thread* ts = (Thread*) calloc(nthreads, sizeof(Thread));
+    Queue* qs = (Queue*) aligned_alloc(64, nthreads * sizeof(Queue));
+    memset(qs, 0, nthreads * sizeof(Queue));
+    pthread_t* tids = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+    pthread_barrier_init(&g_barrier, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; i++) {
+        ts[i].a = a;
+        ts[i].id = i;
+        ts[i].ops = ops;
+        ts[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        ts[i].queue = &qs[i / 2];
+        ts[i].producer = !(i & 1);
+        ts[i].frag = -1;
+        pthread_create(&tids[i], NULL, thread_fn, &ts[i]);
+    }
+
+    pthread_barrier_wait(&g_barrier);
+    unsigned long long start = now_ns();
+    for (int i = 0; i < nthreads; i++) pthread_join(tids[i], NULL);
+    double secs = (now_ns() - start) / 1e9;
+
+    Result r;
+    Histogram h;
+    memset(&r, 0, sizeof(r));
+    memset(&h, 0, sizeof(h));
+    for (int i = 0; i < nthreads; i++) {
+        r.ops += ts[i].done;
+        for (int b = 0; b < LAT_BUCKETS; b++) h.count[b] += ts[i].hist.count[b];
+    }
+    r.secs = secs;
+    r.p50 = percentile(&h, 0.5);
+    r.p99 = percentile(&h, 0.99);
+    r.p999 = percentile(&h, 0.999);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    r.rss_kb = ru.ru_maxrss;
+    r.frag = ts[0].frag;
+    if (write(fd, &r, sizeof(r)) != (ssize_t) sizeof(r)) exit(1);
+
+    if (g_mp) MemoryPoolDestroy(g_mp);
+    exit(0);
+}
+
+static int run(const Workload* wl, const Allocator* a, int nthreads, long ops, Result* r) {
+    int fds[2];
+    if (pipe(fds)) return 1;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) return 1;
+    if (pid == 0) {
+        close(fds[0]);
+        run_child(wl, a, nthreads, ops, fds[1]);
+    }
+    close(fds[1]);
+    ssize_t n = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return n != (ssize_t) sizeof(*r) || !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static int selected(const char* name, int argc, char** argv) {
+    if (argc <= 3) return 1;
+    for (int i = 3; i < argc; i++)
+        if (!strcmp(argv[i], name)) return 1;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int) (ncpu < 1 ? 1 : ncpu > 8 ? 8 : ncpu);
+    long ops = argc > 2 ? atol(argv[2]) : DEFAULT_OPS;
+    if (max_threads < 1 || ops < 2) {
+        printf("usage: %s [max_threads] [ops_per_thread] [workload...]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-18s %4s %-7s %10s %8s %9s %9s %9s %10s %6s\n",
+           "workload", "thr", "alloc", "Mops/s", "vs malloc", "p50(ns)", "p99(ns)", "p999(ns)", "peakRSS(MB)",
+           "frag");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        const Workload* wl = &workloads[w];
+        if (!selected(wl->name, argc, argv)) continue;
+        // 线程数取 1 2 4 ... 以及 max_threads, 成对负载取偶数且至少2个线程
+        int last = 0;
+        for (int n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+            int nthreads = wl->paired ? (n < 2 ? 2 : n & ~1) : n;
+            if (nthreads == last) {
+                if (n == max_threads) break;
+                continue;
+            }
+            last = nthreads;
+            double base = 0;
+            for (size_t k = 0; k < sizeof(allocators) / sizeof(allocators[0]); k++) {
+                Result r;
+                if (run(wl, &allocators[k], nthreads, ops, &r)) {
+                    printf("%-18s %4d %-7s failed\n", wl->name, nthreads, allocators[k].name);
+                    continue;
+                }
+                double mops = r.ops / r.secs / 1e6;
+                if (k == 0) base = mops;
+                printf("%-18s %4d %-7s %10.2f %8.2fx %9llu %9llu %9llu %10.1f ",
+                       wl->name, nthreads, allocators[k].name, mops, base ? mops / base : 0,
+                       r.p50, r.p99, r.p999, r.rss_kb / 1024.0);
+                if (r.frag < 0)
+                    printf("%6s\n", "-");
+                else
+                    printf("%6.3f\n", r.frag);
+            }
+            if (n == max_threads) break;
+        }
+    }
+    return 0;
+}
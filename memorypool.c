@@ -1,381 +1,3146 @@
-#include "memorypool.h"
-
-#define MP_CHUNKHEADER sizeof(struct _mp_chunk)
-#define MP_CHUNKEND sizeof(struct _mp_chunk*)
-
-#define MP_LOCK(lockobj)                    \
-    do {                                    \
-        pthread_mutex_lock(&lockobj->lock); \
-    } while (0)
-#define MP_UNLOCK(lockobj)                    \
-    do {                                      \
-        pthread_mutex_unlock(&lockobj->lock); \
-    } while (0)
-
-#define MP_ALIGN_SIZE(_n) (((uintptr_t) (_n) + ((sizeof(long)) - 1)) & ~((uintptr_t) ((sizeof(long)) - 1)))
-
-#define MP_INIT_MEMORY_STRUCT(mm, mempool_sz)   \
-    do {                                        \
-        mm->mempool_size = mempool_sz;          \
-        mm->alloc_mem = 0;                      \
-        mm->alloc_prog_mem = 0;                 \
-        mm->free_list = (_MP_Chunk*) mm->start; \
-        mm->free_list->is_free = 1;             \
-        mm->free_list->alloc_mem = mempool_sz;  \
-        mm->free_list->prev = NULL;             \
-        mm->free_list->next = NULL;             \
-        mm->alloc_list = NULL;                  \
-    } while (0)
-
-#define MP_DLINKLIST_INS_FRT(head, x) \
-    do {                              \
-        x->prev = NULL;               \
-        x->next = head;               \
-        if (head) head->prev = x;     \
-        head = x;                     \
-    } while (0)
-
-#define MP_DLINKLIST_DEL(head, x)                 \
-    do {                                          \
-        if (!x->prev) {                           \
-            head = x->next;                       \
-            if (x->next) x->next->prev = NULL;    \
-        } else {                                  \
-            x->prev->next = x->next;              \
-            if (x->next) x->next->prev = x->prev; \
-        }                                         \
-    } while (0)
-
-void get_memory_list_count(MemoryPool* mp, mem_size_t* mlist_len) {
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_LOCK(mp);
-#endif
-    mem_size_t mlist_l = 0;
-    _MP_Memory* mm = mp->mlist;
-    while (mm) {
-        mlist_l++;
-        mm = mm->next;
-    }
-    *mlist_len = mlist_l;
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_UNLOCK(mp);
-#endif
-}
-
-void get_memory_info(MemoryPool* mp,
-                     _MP_Memory* mm,
-                     mem_size_t* free_list_len,
-                     mem_size_t* alloc_list_len) {
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_LOCK(mp);
-#endif
-    mem_size_t free_l = 0, alloc_l = 0;
-    _MP_Chunk* p = mm->free_list;
-    while (p) {
-        free_l++;
-        p = p->next;
-    }
-
-    p = mm->alloc_list;
-    while (p) {
-        alloc_l++;
-        p = p->next;
-    }
-    *free_list_len = free_l;
-    *alloc_list_len = alloc_l;
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_UNLOCK(mp);
-#endif
-}
-
-int get_memory_id(_MP_Memory* mm) {
-    return mm->id;
-}
-
-static _MP_Memory* extend_memory_list(MemoryPool* mp, mem_size_t new_mempool_sz) {
-    char* s = (char*) malloc(sizeof(_MP_Memory) + new_mempool_sz * sizeof(char));
-    if (!s) return NULL;
-
-    _MP_Memory* mm = (_MP_Memory*) s;
-    mm->start = s + sizeof(_MP_Memory);
-
-    MP_INIT_MEMORY_STRUCT(mm, new_mempool_sz);
-    mm->id = mp->last_id++;
-    mm->next = mp->mlist;
-    mp->mlist = mm;
-    return mm;
-}
-
-static _MP_Memory* find_memory_list(MemoryPool* mp, void* p) {
-    _MP_Memory* tmp = mp->mlist;
-    while (tmp) {
-        if (tmp->start <= (char*) p &&
-            tmp->start + mp->mempool_size > (char*) p)
-            break;
-        tmp = tmp->next;
-    }
-
-    return tmp;
-}
-
-static int merge_free_chunk(MemoryPool* mp, _MP_Memory* mm, _MP_Chunk* c) {
-    _MP_Chunk *p0 = c, *p1 = c;
-    while (p0->is_free) {
-        p1 = p0;
-        if ((char*) p0 - MP_CHUNKEND - MP_CHUNKHEADER <= mm->start) break;
-        p0 = *(_MP_Chunk**) ((char*) p0 - MP_CHUNKEND);
-    }
-
-    p0 = (_MP_Chunk*) ((char*) p1 + p1->alloc_mem);
-    while ((char*) p0 < mm->start + mp->mempool_size && p0->is_free) {
-        MP_DLINKLIST_DEL(mm->free_list, p0);
-        p1->alloc_mem += p0->alloc_mem;
-        p0 = (_MP_Chunk*) ((char*) p0 + p0->alloc_mem);
-    }
-
-    *(_MP_Chunk**) ((char*) p1 + p1->alloc_mem - MP_CHUNKEND) = p1;
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_UNLOCK(mp);
-#endif
-    return 0;
-}
-
-MemoryPool* MemoryPoolInit(mem_size_t max_mempool_size, mem_size_t mempool_size) {
-    if (mempool_size > max_mempool_size) {
-        // printf("[MemoryPool_Init] MemPool Init ERROR! Mempoolsize is too big!
-        // \n");
-        return NULL;
-    }
-
-    MemoryPool* mp = (MemoryPool*) malloc(sizeof(MemoryPool));
-    if (!mp) return NULL;
-
-    mp->last_id = 0;
-    if (mempool_size < max_mempool_size) mp->auto_extend = 1;
-    mp->max_mempool_size = max_mempool_size;
-    mp->alloc_mempool_size = mp->mempool_size = mempool_size; // 初始分配一个内存池
-
-#ifdef _Z_MEMORYPOOL_THREAD_
-    pthread_mutex_init(&mp->lock, NULL);
-#endif
-
-    char* s = (char*) malloc(sizeof(_MP_Memory) +
-                             sizeof(char) * mp->mempool_size);
-    if (!s) {
-        free(mp);
-        return NULL;
-    }
-
-    mp->mlist = (_MP_Memory*) s;
-    mp->mlist->start = s + sizeof(_MP_Memory);
-    MP_INIT_MEMORY_STRUCT(mp->mlist, mp->mempool_size);
-    mp->mlist->next = NULL;
-    mp->mlist->id = mp->last_id++;
-
-    return mp;
-}
-
-void* MemoryPoolAlloc(MemoryPool* mp, mem_size_t wantsize) {
-    if (wantsize <= 0) return NULL;
-    mem_size_t total_needed_size =
-            MP_ALIGN_SIZE(wantsize + MP_CHUNKHEADER + MP_CHUNKEND);
-    if (total_needed_size > mp->mempool_size) return NULL;
-
-    _MP_Memory *mm = NULL;
-    _MP_Chunk *_free = NULL, *_not_free = NULL;
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_LOCK(mp);
-#endif
-FIND_FREE_CHUNK:
-    mm = mp->mlist;
-    while (mm) {
-        if (mp->mempool_size - mm->alloc_mem < total_needed_size) {
-            mm = mm->next;
-            continue;
-        }
-
-        _free = mm->free_list;
-        _not_free = NULL;
-
-        while (_free) {
-            if (_free->alloc_mem >= total_needed_size) {
-                // 如果free块分割后剩余内存足够大 则进行分割
-                if (_free->alloc_mem - total_needed_size >
-                    MP_CHUNKHEADER + MP_CHUNKEND) {
-                    // 从free块头开始分割出alloc块
-                    _not_free = _free;
-
-                    _free = (_MP_Chunk*) ((char*) _not_free +
-                                          total_needed_size);
-                    *_free = *_not_free;
-                    _free->alloc_mem -= total_needed_size;
-                    *(_MP_Chunk**) ((char*) _free + _free->alloc_mem -
-                                    MP_CHUNKEND) = _free;
-
-                    // update free_list
-                    if (!_free->prev) {
-                        mm->free_list = _free;
-                    } else {
-                        _free->prev->next = _free;
-                    }
-                    if (_free->next) _free->next->prev = _free;
-
-                    _not_free->is_free = 0;
-                    _not_free->alloc_mem = total_needed_size;
-
-                    *(_MP_Chunk**) ((char*) _not_free + total_needed_size -
-                                    MP_CHUNKEND) = _not_free;
-                }
-                // 不够 则整块分配为alloc
-                else {
-                    _not_free = _free;
-                    MP_DLINKLIST_DEL(mm->free_list, _not_free);
-                    _not_free->is_free = 0;
-                }
-                MP_DLINKLIST_INS_FRT(mm->alloc_list, _not_free);
-
-                mm->alloc_mem += _not_free->alloc_mem;
-                mm->alloc_prog_mem +=
-                        (_not_free->alloc_mem - MP_CHUNKHEADER - MP_CHUNKEND);
-#ifdef _Z_MEMORYPOOL_THREAD_
-                MP_UNLOCK(mp);
-#endif
-                return (void*) ((char*) _not_free + MP_CHUNKHEADER);
-            }
-            _free = _free->next;
-        }
-
-        mm = mm->next;
-    }
-
-    if (mp->auto_extend) {
-        // 超过总内存限制
-        if (mp->alloc_mempool_size + total_needed_size > mp->max_mempool_size) {
-            goto err_out;
-        }
-        // 剩余可新增内存池大小
-        mem_size_t add_mem_sz = mp->max_mempool_size - mp->mempool_size;
-        // 如果空间足够则按 mempool_size 新增, 不足则分配剩下所有内存
-        add_mem_sz = add_mem_sz >= mp->mempool_size ? mp->mempool_size
-                                                     : add_mem_sz;
-        if (!extend_memory_list(mp, add_mem_sz)) goto err_out;
-        // 更新实际分配内存
-        mp->alloc_mempool_size += add_mem_sz;
-
-        goto FIND_FREE_CHUNK;
-    }
-
-err_out:
-// printf("[MemoryPool_Alloc] No enough memory! \n");
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_UNLOCK(mp);
-#endif
-    return NULL;
-}
-
-int MemoryPoolFree(MemoryPool* mp, void* p) {
-    if (p == NULL || mp == NULL) return 1;
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_LOCK(mp);
-#endif
-    _MP_Memory* mm = mp->mlist;
-    if (mp->auto_extend) mm = find_memory_list(mp, p);
-
-    _MP_Chunk* ck = (_MP_Chunk*) ((char*) p - MP_CHUNKHEADER);
-
-    MP_DLINKLIST_DEL(mm->alloc_list, ck);
-    MP_DLINKLIST_INS_FRT(mm->free_list, ck);
-    ck->is_free = 1;
-
-    mm->alloc_mem -= ck->alloc_mem;
-    mm->alloc_prog_mem -= (ck->alloc_mem - MP_CHUNKHEADER - MP_CHUNKEND);
-
-    return merge_free_chunk(mp, mm, ck);
-}
-
-MemoryPool* MemoryPoolClear(MemoryPool* mp) {
-    if (!mp) return NULL;
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_LOCK(mp);
-#endif
-    _MP_Memory* mm = mp->mlist;
-    while (mm) {
-        MP_INIT_MEMORY_STRUCT(mm, mm->mempool_size);
-        mm = mm->next;
-    }
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_UNLOCK(mp);
-#endif
-    return mp;
-}
-
-int MemoryPoolDestroy(MemoryPool* mp) {
-    if (mp == NULL) return 1;
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_LOCK(mp);
-#endif
-    _MP_Memory *mm = mp->mlist, *mm1 = NULL;
-    while (mm) {
-        mm1 = mm;
-        mm = mm->next;
-        free(mm1);
-    }
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_UNLOCK(mp);
-    pthread_mutex_destroy(&mp->lock);
-#endif
-    free(mp);
-    return 0;
-}
-
-mem_size_t GetTotalMemory(MemoryPool* mp) {
-    return mp->alloc_mempool_size;
-}
-
-mem_size_t GetUsedMemory(MemoryPool* mp) {
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_LOCK(mp);
-#endif
-    mem_size_t total_alloc = 0;
-    _MP_Memory* mm = mp->mlist;
-    while (mm) {
-        total_alloc += mm->alloc_mem;
-        mm = mm->next;
-    }
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_UNLOCK(mp);
-#endif
-    return total_alloc;
-}
-
-mem_size_t GetProgMemory(MemoryPool* mp) {
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_LOCK(mp);
-#endif
-    mem_size_t total_alloc_prog = 0;
-    _MP_Memory* mm = mp->mlist;
-    while (mm) {
-        total_alloc_prog += mm->alloc_prog_mem;
-        mm = mm->next;
-    }
-#ifdef _Z_MEMORYPOOL_THREAD_
-    MP_UNLOCK(mp);
-#endif
-    return total_alloc_prog;
-}
-
-float MemoryPoolGetUsage(MemoryPool* mp) {
-    return (float) GetUsedMemory(mp) / GetTotalMemory(mp);
-}
-
-float MemoryPoolGetProgUsage(MemoryPool* mp) {
-    return (float) GetProgMemory(mp) / GetTotalMemory(mp);
-}
-
-#undef MP_CHUNKHEADER
-#undef MP_CHUNKEND
-#undef MP_LOCK
-#undef MP_ALIGN_SIZE
-#undef MP_INIT_MEMORY_STRUCT
-#undef MP_DLINKLIST_INS_FRT
-#undef MP_DLINKLIST_DEL
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // sched_getcpu
+#endif
+#include "memorypool.h"
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+#include <sched.h>
+#endif
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// 已分配块只有块头, free块额外在末尾有块尾
+#define MP_CHUNKHEADER sizeof(mem_size_t)
+#define MP_CHUNKEND sizeof(mem_size_t)
+
+#define MP_LOCK(lockobj)                    \
+    do {                                    \
+        pthread_mutex_lock(&lockobj->lock); \
+    } while (0)
+#define MP_UNLOCK(lockobj)                    \
+    do {                                      \
+        pthread_mutex_unlock(&lockobj->lock); \
+    } while (0)
+#define MP_TRYLOCK(lockobj) (pthread_mutex_trylock(&lockobj->lock) == 0)
+
+// 统计值可在不加锁的情况下读取
+#ifdef _Z_MEMORYPOOL_THREAD_
+#define MP_ATOMIC_ADD(ptr, n) __atomic_fetch_add((ptr), (n), __ATOMIC_RELAXED)
+#define MP_ATOMIC_SUB(ptr, n) __atomic_fetch_sub((ptr), (n), __ATOMIC_RELAXED)
+#define MP_ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define MP_ATOMIC_STORE(ptr, n) __atomic_store_n((ptr), (n), __ATOMIC_RELAXED)
+// 地址索引被各分片共用, 查找时不持有写入方的锁
+#define MP_ACQUIRE_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define MP_RELEASE_STORE(ptr, n) __atomic_store_n((ptr), (n), __ATOMIC_RELEASE)
+#else
+#define MP_ATOMIC_ADD(ptr, n) (*(ptr) += (n))
+#define MP_ATOMIC_SUB(ptr, n) (*(ptr) -= (n))
+#define MP_ATOMIC_LOAD(ptr) (*(ptr))
+#define MP_ATOMIC_STORE(ptr, n) (*(ptr) = (n))
+#define MP_ACQUIRE_LOAD(ptr) (*(ptr))
+#define MP_RELEASE_STORE(ptr, n) (*(ptr) = (n))
+#endif
+// 只在持有锁时修改的计数器: 写者唯一, 不需要带锁前缀的原子加
+#define MP_STAT_ADD(ptr, n) MP_ATOMIC_STORE((ptr), MP_ATOMIC_LOAD(ptr) + (n))
+
+#define MP_CHUNK_SIZE(ck) ((ck)->head & ~(mem_size_t) MP_CHUNK_FLAGS)
+#define MP_CHUNK_IS_FREE(ck) ((ck)->head & MP_CHUNK_FREE)
+#define MP_CHUNK_IS_ZERO(ck) ((ck)->head & MP_CHUNK_ZERO)
+#define MP_CHUNK_NEXT(ck) ((_MP_Chunk*) ((char*) (ck) + MP_CHUNK_SIZE(ck)))
+// free块的块尾: 块大小 | 页归还状态
+#define MP_CHUNK_FOOT(ck) (*(mem_size_t*) ((char*) (ck) + MP_CHUNK_SIZE(ck) - MP_CHUNKEND))
+#define MP_CHUNK_PURGE(ck) (MP_CHUNK_FOOT(ck) & MP_CHUNK_FLAGS)
+
+// 块中实际可供程序使用的大小
+#define MP_CHUNK_PROG_SIZE(ck) (MP_CHUNK_SIZE(ck) - MP_CHUNKHEADER)
+
+// 最佳适配模式下free块在链表指针之后还有树指针, 每个桶内的free块按(大小, 地址)组成树堆
+typedef struct _mp_tree_chunk {
+    _MP_Chunk ck;
+    struct _mp_tree_chunk *left, *right;
+} _MP_TreeChunk;
+
+// free块数据区开头保留的管理信息, 不随 MP_CHUNK_ZERO 清零, 也不归还系统
+#define MP_FREE_META sizeof(_MP_TreeChunk)
+
+// 可独立存在的最小块, 释放后要放得下链表指针(最佳适配模式还有树指针)与块尾
+#define MP_CHUNK_MIN(mp) \
+    (((mp)->policy == MP_POLICY_BEST_FIT ? sizeof(_MP_TreeChunk) : sizeof(_MP_Chunk)) + MP_CHUNKEND)
+
+// 伙伴块最小为 2^MP_BUDDY_MIN_ORDER 字节
+#define MP_BUDDY_MIN_ORDER 6
+
+#define MP_ALIGN_SIZE(_n) (((uintptr_t) (_n) + ((sizeof(long)) - 1)) & ~((uintptr_t) ((sizeof(long)) - 1)))
+#define MP_ALIGN_UP(_n, _a) (((mem_size_t) (_n) + (_a) - 1) & ~(mem_size_t) ((_a) - 1))
+
+#define MP_INIT_MEMORY_STRUCT(mp, mm, mempool_sz, zero)  \
+    do {                                                 \
+        mm->mempool_size = mempool_sz;                   \
+        mm->alloc_mem = 0;                               \
+        mm->alloc_prog_mem = 0;                          \
+        mm->bin_bitmap = 0;                              \
+        memset(mm->free_bins, 0, sizeof(mm->free_bins)); \
+        memset(mm->free_trees, 0, sizeof(mm->free_trees)); \
+        mm->alloc_chunks = 0;                            \
+        init_free_chunks(mp, mm, zero);                  \
+    } while (0)
+
+#define MP_DLINKLIST_INS_FRT(head, x) \
+    do {                              \
+        x->prev = NULL;               \
+        x->next = head;               \
+        if (head) head->prev = x;     \
+        head = x;                     \
+    } while (0)
+
+#define MP_DLINKLIST_DEL(head, x)                 \
+    do {                                          \
+        if (!x->prev) {                           \
+            head = x->next;                       \
+            if (x->next) x->next->prev = NULL;    \
+        } else {                                  \
+            x->prev->next = x->next;              \
+            if (x->next) x->next->prev = x->prev; \
+        }                                         \
+    } while (0)
+
+// size所在桶: [2^k, 1.5*2^k) 与 [1.5*2^k, 2^(k+1)) 各占一个桶
+static inline unsigned int bin_index(mem_size_t sz) {
+    if (sz < 16) return 0;
+    unsigned int k = 63 - __builtin_clzll(sz);
+    unsigned int idx = ((k - 4) << 1) | ((sz >> (k - 1)) & 1);
+    return idx < MP_BIN_COUNT ? idx : MP_BIN_COUNT - 1;
+}
+
+// 桶内最小的size
+static inline mem_size_t bin_lower_size(unsigned int idx) {
+    return (mem_size_t) (2 | (idx & 1)) << ((idx >> 1) + 3);
+}
+
+static mem_size_t purge_range(struct _mp_mempool* mp, _MP_Chunk* ck, char** lo, char** hi);
+#ifdef _Z_MEMORYPOOL_THREAD_
+static void remote_drain_locked(struct _mp_mempool* mp);
+#endif
+
+// 紧随其后的块的 MP_CHUNK_PREV_FREE 标志, 伙伴模式不使用
+// 非伙伴模式内存块末尾有一个哨兵块头, 最后一个块之后总有块头可写
+// 后一块可能是其他线程正在不加锁读取块头的已分配块, 块头只在持有锁时修改, 整体原子写入
+static inline void mark_next_chunk(_MP_Memory* mm, _MP_Chunk* ck, int free) {
+    if (mm->pool->policy == MP_POLICY_BUDDY) return;
+    _MP_Chunk* next = MP_CHUNK_NEXT(ck);
+    MP_ATOMIC_STORE(&next->head, free ? next->head | MP_CHUNK_PREV_FREE
+                                      : next->head & ~(mem_size_t) MP_CHUNK_PREV_FREE);
+}
+
+// 非伙伴模式内存块已提交部分末尾的哨兵块头(大小为0的已分配块), 按 sizeof(long) 向下对齐
+static inline _MP_Chunk* memory_fence(_MP_Memory* mm) {
+    return (_MP_Chunk*) ((uintptr_t) (mm->start + mm->commit_size - MP_CHUNKHEADER) &
+                         ~(uintptr_t) (sizeof(long) - 1));
+}
+
+// 由块尾找到前一个free块, 需 MP_CHUNK_PREV_FREE
+static inline _MP_Chunk* prev_chunk(_MP_Chunk* ck) {
+    mem_size_t foot = *(mem_size_t*) ((char*) ck - MP_CHUNKEND);
+    return (_MP_Chunk*) ((char*) ck - (foot & ~(mem_size_t) MP_CHUNK_FLAGS));
+}
+
+/*
+ *  最佳适配: 树堆以(大小, 地址)为键, 优先级由地址散列得到, 不需要额外存储
+ */
+
+static inline uintptr_t tree_priority(_MP_TreeChunk* t) {
+    return ((uintptr_t) t >> 3) * (uintptr_t) 0x9E3779B97F4A7C15ull;
+}
+
+static inline int tree_less(_MP_TreeChunk* a, _MP_TreeChunk* b) {
+    return MP_CHUNK_SIZE(&a->ck) < MP_CHUNK_SIZE(&b->ck) ||
+           (MP_CHUNK_SIZE(&a->ck) == MP_CHUNK_SIZE(&b->ck) && a < b);
+}
+
+// 沿查找路径下降到优先级低于 x 的位置, 将该子树按 x 拆分为左右子树
+static void tree_insert(_MP_Chunk** root, _MP_TreeChunk* x) {
+    _MP_TreeChunk** link = (_MP_TreeChunk**) root;
+    uintptr_t pri = tree_priority(x);
+    while (*link && tree_priority(*link) >= pri)
+        link = tree_less(x, *link) ? &(*link)->left : &(*link)->right;
+
+    _MP_TreeChunk *t = *link, **l = &x->left, **r = &x->right;
+    while (t) {
+        if (tree_less(t, x)) {
+            *l = t;
+            l = &t->right;
+            t = t->right;
+        } else {
+            *r = t;
+            r = &t->left;
+            t = t->left;
+        }
+    }
+    *l = *r = NULL;
+    *link = x;
+}
+
+// 按键找到 x, 用其左右子树合并的结果替换
+static void tree_remove(_MP_Chunk** root, _MP_TreeChunk* x) {
+    _MP_TreeChunk** link = (_MP_TreeChunk**) root;
+    while (*link != x) link = tree_less(x, *link) ? &(*link)->left : &(*link)->right;
+
+    _MP_TreeChunk *l = x->left, *r = x->right;
+    while (l && r) {
+        if (tree_priority(l) >= tree_priority(r)) {
+            *link = l;
+            link = &l->right;
+            l = l->right;
+        } else {
+            *link = r;
+            link = &r->left;
+            r = r->left;
+        }
+    }
+    *link = l ? l : r;
+}
+
+// 不小于 sz 的最小块, 大小相同时取地址最低的
+static _MP_Chunk* tree_lower_bound(_MP_Chunk* root, mem_size_t sz) {
+    _MP_TreeChunk *t = (_MP_TreeChunk*) root, *best = NULL;
+    while (t) {
+        if (MP_CHUNK_SIZE(&t->ck) >= sz) {
+            best = t;
+            t = t->left;
+        } else {
+            t = t->right;
+        }
+    }
+    return (_MP_Chunk*) best;
+}
+
+static void insert_free_chunk(_MP_Memory* mm, _MP_Chunk* ck) {
+    unsigned int idx = bin_index(MP_CHUNK_SIZE(ck));
+    MP_CHUNK_FOOT(ck) = MP_CHUNK_SIZE(ck) | MP_PURGE_NONE;
+    MP_DLINKLIST_INS_FRT(mm->free_bins[idx], ck);
+    if (mm->pool->policy == MP_POLICY_BEST_FIT) tree_insert(&mm->free_trees[idx], (_MP_TreeChunk*) ck);
+    mm->bin_bitmap |= (mem_size_t) 1 << idx;
+    MP_ATOMIC_ADD(&mm->pool->stats.free_chunks, 1);
+    mark_next_chunk(mm, ck, 1);
+}
+
+static void remove_free_chunk(_MP_Memory* mm, _MP_Chunk* ck) {
+    unsigned int idx = bin_index(MP_CHUNK_SIZE(ck));
+    MP_DLINKLIST_DEL(mm->free_bins[idx], ck);
+    if (mm->pool->policy == MP_POLICY_BEST_FIT) tree_remove(&mm->free_trees[idx], (_MP_TreeChunk*) ck);
+    if (!mm->free_bins[idx]) mm->bin_bitmap &= ~((mem_size_t) 1 << idx);
+    MP_ATOMIC_SUB(&mm->pool->stats.free_chunks, 1);
+    // 已归还的页再次使用时由系统重新分配
+    if (MP_CHUNK_PURGE(ck) == MP_PURGE_DONE) {
+        char *lo, *hi;
+        MP_ATOMIC_SUB(&mm->pool->stats.purged_mem, purge_range(mm->pool, ck, &lo, &hi));
+    }
+}
+
+// 找到一个不小于 sz 的free块
+// 先从下限不小于sz的桶中取(桶内任意块都满足), 找不到再在sz所在桶内first fit
+// 最佳适配模式先在sz所在桶的树中找最小的满足块, 找不到再取之后第一个非空桶中最小的块
+static _MP_Chunk* find_free_chunk(_MP_Memory* mm, mem_size_t sz) {
+    unsigned int idx = bin_index(sz);
+    unsigned int fit = idx;
+    if (mm->pool->policy == MP_POLICY_BEST_FIT) {
+        _MP_Chunk* ck = tree_lower_bound(mm->free_trees[idx], sz);
+        if (ck || idx == MP_BIN_COUNT - 1) return ck;
+        mem_size_t mask = mm->bin_bitmap & (~(mem_size_t) 0 << (idx + 1));
+        return mask ? tree_lower_bound(mm->free_trees[__builtin_ctzll(mask)], 0) : NULL;
+    }
+    if (fit < MP_BIN_COUNT - 1 && bin_lower_size(fit) < sz) fit++;
+
+    _MP_Chunk* ck = NULL;
+    mem_size_t mask = mm->bin_bitmap & (~(mem_size_t) 0 << fit);
+    if (mask) {
+        ck = mm->free_bins[__builtin_ctzll(mask)];
+        // 只有最后一个桶没有上限, 需要检查
+        while (ck && MP_CHUNK_SIZE(ck) < sz) ck = ck->next;
+        if (ck) return ck;
+    }
+    if (fit == idx) return NULL;
+
+    ck = mm->free_bins[idx];
+    while (ck && MP_CHUNK_SIZE(ck) < sz) ck = ck->next;
+    return ck;
+}
+
+void get_memory_list_count(MemoryPool* mp, mem_size_t* mlist_len) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) {
+        mem_size_t n, sum = 0;
+        unsigned int i;
+        for (i = 0; i < mp->arena_count; i++) {
+            get_memory_list_count(mp->arenas[i], &n);
+            sum += n;
+        }
+        *mlist_len = sum;
+        return;
+    }
+    MP_LOCK(mp);
+#endif
+    mem_size_t mlist_l = 0;
+    _MP_Memory* mm = mp->mlist;
+    while (mm) {
+        mlist_l++;
+        mm = mm->next;
+    }
+    *mlist_len = mlist_l;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+}
+
+void get_memory_info(MemoryPool* mp,
+                     _MP_Memory* mm,
+                     mem_size_t* free_list_len,
+                     mem_size_t* alloc_list_len) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) mp = mm->pool;
+    MP_LOCK(mp);
+#endif
+    mem_size_t free_l = 0;
+    _MP_Chunk* p = NULL;
+    mem_size_t mask = mm->bin_bitmap;
+    while (mask) {
+        p = mm->free_bins[__builtin_ctzll(mask)];
+        while (p) {
+            free_l++;
+            p = p->next;
+        }
+        mask &= mask - 1;
+    }
+
+    *free_list_len = free_l;
+    *alloc_list_len = mm->alloc_chunks;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+}
+
+int get_memory_id(_MP_Memory* mm) {
+    return mm->id;
+}
+
+// 不小于 sz 的最小2的幂
+static inline mem_size_t buddy_size(mem_size_t sz) {
+    if (sz <= ((mem_size_t) 1 << MP_BUDDY_MIN_ORDER))
+        return (mem_size_t) 1 << MP_BUDDY_MIN_ORDER;
+    return (mem_size_t) 1 << (64 - __builtin_clzll(sz - 1));
+}
+
+// 不大于 sz 的最大2的幂
+static inline mem_size_t buddy_floor_size(mem_size_t sz) {
+    return sz ? (mem_size_t) 1 << (63 - __builtin_clzll(sz)) : 0;
+}
+
+// 块尾在放入桶时写入
+static inline void init_free_chunk(_MP_Chunk* ck, mem_size_t sz, int zero) {
+    ck->head = sz | MP_CHUNK_FREE | (zero ? MP_CHUNK_ZERO : 0);
+}
+
+// 相邻的两个free块合并, lo 吸收 hi(均已移出桶, 不写块尾)
+// 两块内容都为0时, 清零中间的块尾与 hi 的块头和链表/树指针, 合并后仍为0
+static inline void join_free_chunks(_MP_Chunk* lo, _MP_Chunk* hi) {
+    mem_size_t zero = lo->head & hi->head & MP_CHUNK_ZERO;
+    lo->head = (MP_CHUNK_SIZE(lo) + MP_CHUNK_SIZE(hi)) | (lo->head & MP_CHUNK_PREV_FREE) | MP_CHUNK_FREE | zero;
+    if (zero)
+        memset((char*) hi - MP_CHUNKEND, 0,
+               MP_CHUNKEND + (MP_CHUNK_SIZE(hi) < MP_FREE_META ? MP_CHUNK_SIZE(hi) : MP_FREE_META));
+}
+
+// 将整块内存划分为初始free块, zero 表示内存刚从系统获得(内容全为0)
+// 伙伴模式下按从大到小的2的幂依次切分, 每块的偏移都是其大小的整数倍
+static void init_free_chunks(MemoryPool* mp, _MP_Memory* mm, int zero) {
+    if (mp->policy == MP_POLICY_REGION) return;
+    if (mp->policy != MP_POLICY_BUDDY) {
+        _MP_Chunk* ck = (_MP_Chunk*) mm->start;
+        init_free_chunk(ck, (char*) memory_fence(mm) - mm->start, zero);
+        memory_fence(mm)->head = 0;
+        insert_free_chunk(mm, ck);
+        return;
+    }
+
+    mem_size_t off = 0, sz;
+    while ((sz = buddy_floor_size(mm->mempool_size - off)) >=
+           ((mem_size_t) 1 << MP_BUDDY_MIN_ORDER)) {
+        _MP_Chunk* ck = (_MP_Chunk*) (mm->start + off);
+        init_free_chunk(ck, sz, zero);
+        insert_free_chunk(mm, ck);
+        off += sz;
+    }
+}
+
+// 从free块头开始分割出alloc块, 剩余部分足够大则放回对应的桶
+static _MP_Chunk* first_fit_alloc_chunk(_MP_Memory* mm, mem_size_t need) {
+    _MP_Chunk* ck = find_free_chunk(mm, need);
+    if (!ck) return NULL;
+
+    remove_free_chunk(mm, ck);
+    if (MP_CHUNK_SIZE(ck) - need >= MP_CHUNK_MIN(mm->pool)) {
+        _MP_Chunk* rest = (_MP_Chunk*) ((char*) ck + need);
+        init_free_chunk(rest, MP_CHUNK_SIZE(ck) - need, MP_CHUNK_IS_ZERO(ck));
+        insert_free_chunk(mm, rest);
+        ck->head = need | (ck->head & MP_CHUNK_FLAGS);
+        MP_STAT_ADD(&mm->pool->stats.split_count, 1);
+    } else {
+        mark_next_chunk(mm, ck, 0);
+    }
+    return ck;
+}
+
+// 找到最小的可用块, 逐级对半分割直到大小为 need
+static _MP_Chunk* buddy_alloc_chunk(_MP_Memory* mm, mem_size_t need) {
+    _MP_Chunk* ck = find_free_chunk(mm, need);
+    if (!ck) return NULL;
+
+    remove_free_chunk(mm, ck);
+    while (MP_CHUNK_SIZE(ck) > need) {
+        ck->head = (MP_CHUNK_SIZE(ck) >> 1) | (ck->head & MP_CHUNK_FLAGS);
+        _MP_Chunk* buddy = MP_CHUNK_NEXT(ck);
+        init_free_chunk(buddy, MP_CHUNK_SIZE(ck), MP_CHUNK_IS_ZERO(ck));
+        insert_free_chunk(mm, buddy);
+        MP_STAT_ADD(&mm->pool->stats.split_count, 1);
+    }
+    return ck;
+}
+
+// 伙伴地址为 偏移 ^ 块大小, 伙伴同样空闲且大小一致则合并, 直到不能合并
+static void buddy_free_chunk(_MP_Memory* mm, _MP_Chunk* ck) {
+    mem_size_t off = (char*) ck - mm->start, sz = MP_CHUNK_SIZE(ck), buddy_off;
+    while ((buddy_off = off ^ sz) + sz <= mm->mempool_size) {
+        _MP_Chunk* buddy = (_MP_Chunk*) (mm->start + buddy_off);
+        if (!MP_CHUNK_IS_FREE(buddy) || MP_CHUNK_SIZE(buddy) != sz) break;
+        remove_free_chunk(mm, buddy);
+        if (buddy_off < off) {
+            buddy = ck;
+            ck = (_MP_Chunk*) (mm->start + buddy_off);
+            off = buddy_off;
+        }
+        join_free_chunks(ck, buddy);
+        MP_STAT_ADD(&mm->pool->stats.merge_count, 1);
+        sz <<= 1;
+    }
+    insert_free_chunk(mm, ck);
+}
+
+/*
+ *  地址索引: 两级基数树, 以 MP_SEGMENT_SIZE 为粒度将地址映射到所属内存块
+ *  内存块按 MP_SEGMENT_SIZE 对齐分配, 保证每个段最多属于一个内存块
+ */
+
+#define MP_SEGMENT_SHIFT 20
+#define MP_SEGMENT_SIZE ((mem_size_t) 1 << MP_SEGMENT_SHIFT)
+#define MP_PAGEMAP_BITS 14  // 两级共覆盖 48 位地址空间
+#define MP_PAGEMAP_SIZE (1 << MP_PAGEMAP_BITS)
+
+static int pagemap_set(MemoryPool* mp, _MP_Memory* mm, _MP_Memory* val) {
+    uintptr_t seg = (uintptr_t) mm >> MP_SEGMENT_SHIFT;
+    uintptr_t last = ((uintptr_t) mm->start + mm->mempool_size - 1) >> MP_SEGMENT_SHIFT;
+    if (last >> (2 * MP_PAGEMAP_BITS)) return 1;
+
+    for (; seg <= last; seg++) {
+        _MP_Memory*** leaf = &mp->pagemap[seg >> MP_PAGEMAP_BITS];
+        if (!MP_ACQUIRE_LOAD(leaf)) {
+            if (!val) continue;
+            _MP_Memory** fresh = (_MP_Memory**) calloc(MP_PAGEMAP_SIZE, sizeof(_MP_Memory*));
+            if (!fresh) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+            // 各分片共用地址索引, 分别持有自己的锁, 叶子节点可能被同时创建
+            _MP_Memory** expected = NULL;
+            if (!__atomic_compare_exchange_n(leaf, &expected, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                free(fresh);
+#else
+            *leaf = fresh;
+#endif
+        }
+        MP_RELEASE_STORE(&MP_ACQUIRE_LOAD(leaf)[seg & (MP_PAGEMAP_SIZE - 1)], val);
+    }
+    return 0;
+}
+
+static void destroy_pagemap(MemoryPool* mp) {
+    int i;
+    for (i = 0; i < MP_PAGEMAP_SIZE; i++) free(mp->pagemap[i]);
+    free(mp->pagemap);
+}
+
+static mem_size_t page_size(void) {
+    static mem_size_t sz = 0;
+    if (!sz) sz = (mem_size_t) sysconf(_SC_PAGESIZE);
+    return sz;
+}
+
+// 提交/归还内存的粒度, 大页模式下按大页进行以免拆散大页
+static inline mem_size_t page_unit(MemoryPool* mp) {
+    return mp->huge_pages ? MP_HUGE_PAGE_SIZE : page_size();
+}
+
+// 从系统申请按 align 对齐的匿名映射, 内容全为0
+// commit 为0时只预留地址空间, 不可访问也不计入系统的内存提交量
+static void* os_alloc(mem_size_t size, mem_size_t align, int commit) {
+    char* s = (char*) mmap(NULL, size + align, commit ? PROT_READ | PROT_WRITE : PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | (commit ? 0 : MAP_NORESERVE), -1, 0);
+    if (s == (char*) MAP_FAILED) return NULL;
+
+    char* p = (char*) (((uintptr_t) s + align - 1) & ~(uintptr_t) (align - 1));
+    if (p > s) munmap(s, p - s);
+    if (p + size < s + size + align) munmap(p + size, s + size + align - (p + size));
+    return p;
+}
+
+// 从系统预留的大页池申请, size 为大页大小的整数倍, 映射天然按大页对齐
+static void* os_alloc_hugetlb(mem_size_t size) {
+#ifdef MAP_HUGETLB
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+#else
+    return NULL;
+#endif
+}
+
+static void os_free(void* p, mem_size_t size) {
+    munmap(p, size);
+}
+
+static int os_commit(void* p, mem_size_t size) {
+    return mprotect(p, size, PROT_READ | PROT_WRITE);
+}
+
+// 重新映射为不可访问, 同时丢弃物理页并撤销提交
+static int os_decommit(void* p, mem_size_t size) {
+    return mmap(p, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                -1, 0) == MAP_FAILED;
+}
+
+// 内存块起始处到数据区的距离
+// 伙伴模式下块的数据区按 MP_SEGMENT_SIZE(大页模式下按大页) 对齐, 大小为2^k的块数据区天然按 min(2^k, 段大小) 对齐
+// 跳过的部分不会被访问, 不占用物理内存
+static inline mem_size_t memory_head_size(MemoryPool* mp) {
+    // 第一个块的数据区按 min_align 对齐, 块大小都是 min_align 的倍数, 之后的块随之对齐
+    if (mp->policy != MP_POLICY_BUDDY)
+        return MP_ALIGN_UP(sizeof(_MP_Memory) + MP_CHUNKHEADER, mp->min_align) - MP_CHUNKHEADER;
+    return (mp->huge_pages ? MP_HUGE_PAGE_SIZE : MP_SEGMENT_SIZE) - MP_CHUNKHEADER;
+}
+
+static inline mem_size_t memory_map_size(MemoryPool* mp, _MP_Memory* mm) {
+    mem_size_t sz = memory_head_size(mp) + mm->mempool_size;
+    if (mm->huge == MP_HUGE_TLB) sz = (sz + MP_HUGE_PAGE_SIZE - 1) & ~(MP_HUGE_PAGE_SIZE - 1);
+    return sz;
+}
+
+// 大页模式下内存块(含头部)取整到大页大小, 不超过 limit 时向上取整, 否则向下
+static mem_size_t memory_block_size(MemoryPool* mp, mem_size_t sz, mem_size_t limit) {
+    if (!mp->huge_pages) return sz;
+    mem_size_t head = memory_head_size(mp);
+    mem_size_t up = ((head + sz + MP_HUGE_PAGE_SIZE - 1) & ~(MP_HUGE_PAGE_SIZE - 1)) - head;
+    if (up <= limit) return up;
+    mem_size_t down = (head + limit) & ~(MP_HUGE_PAGE_SIZE - 1);
+    return down > head ? down - head : limit;
+}
+
+static _MP_Memory* add_memory(MemoryPool* mp, char* s, mem_size_t map_sz, int huge,
+                              mem_size_t new_mempool_sz, mem_size_t commit_sz);
+
+// 延迟提交模式下只预留 new_mempool_sz 的地址空间并提交前 commit_sz 字节, 否则整块提交
+// 大页模式下优先使用 MAP_HUGETLB, 失败时退回透明大页
+static _MP_Memory* extend_memory_list(MemoryPool* mp, mem_size_t new_mempool_sz, mem_size_t commit_sz) {
+    mem_size_t head = memory_head_size(mp);
+    mem_size_t map_sz = head + new_mempool_sz;
+    int huge = mp->huge_pages;
+    char* s = NULL;
+    if (huge == MP_HUGE_TLB && !mp->lazy_commit) {
+        map_sz = (map_sz + MP_HUGE_PAGE_SIZE - 1) & ~(MP_HUGE_PAGE_SIZE - 1);
+        s = (char*) os_alloc_hugetlb(map_sz);
+    }
+    if (!s) {
+        map_sz = head + new_mempool_sz;
+        if (huge) huge = MP_HUGE_THP;
+        s = (char*) os_alloc(map_sz, huge ? MP_HUGE_PAGE_SIZE : MP_SEGMENT_SIZE, !mp->lazy_commit);
+        if (!s) return NULL;
+#ifdef MADV_HUGEPAGE
+        // 伙伴模式的头部区域只有首尾两页会被访问, 不使用大页
+        mem_size_t skip = mp->policy == MP_POLICY_BUDDY ? MP_HUGE_PAGE_SIZE : 0;
+        if (huge && madvise(s + skip, map_sz - skip, MADV_HUGEPAGE)) huge = MP_HUGE_NONE;
+#else
+        huge = MP_HUGE_NONE;
+#endif
+    }
+
+    if (mp->lazy_commit) {
+        mem_size_t end = (head + commit_sz + page_unit(mp) - 1) & ~(page_unit(mp) - 1);
+        if (end > map_sz) end = map_sz;
+        if (os_commit(s, end)) {
+            os_free(s, map_sz);
+            return NULL;
+        }
+        commit_sz = end - head;
+    }
+    return add_memory(mp, s, map_sz, huge, new_mempool_sz, commit_sz);
+}
+
+// 映射好的区域 s 作为新的内存块加入内存池, 失败时解除映射
+static _MP_Memory* add_memory(MemoryPool* mp, char* s, mem_size_t map_sz, int huge,
+                              mem_size_t new_mempool_sz, mem_size_t commit_sz) {
+    mem_size_t head = memory_head_size(mp);
+    // 只有延迟提交的内存块提交部分小于内存块, 否则地址索引会拒绝超出提交部分的指针
+    assert(mp->lazy_commit || commit_sz == new_mempool_sz);
+    _MP_Memory* mm = (_MP_Memory*) s;
+    mm->pool = mp;
+    mm->huge = huge;
+    mm->large = 0;
+    mm->start = s + head;
+    mm->mempool_size = new_mempool_sz;
+    mm->commit_size = commit_sz;
+    if (pagemap_set(mp, mm, mm)) {
+        pagemap_set(mp, mm, NULL);
+        os_free(s, map_sz);
+        return NULL;
+    }
+
+    MP_INIT_MEMORY_STRUCT(mp, mm, new_mempool_sz, 1);
+    mm->id = mp->last_id++;
+    mm->next = mp->mlist;
+    mp->mlist = mm;
+    // 更新实际分配内存
+    MP_ATOMIC_ADD(&mp->alloc_mempool_size, commit_sz);
+    MP_ATOMIC_ADD(&mp->stats.block_count, 1);
+    return mm;
+}
+
+// O(1) 查找指针所属的内存块, 不属于本内存池则返回NULL
+static _MP_Memory* find_memory_list(MemoryPool* mp, void* p) {
+    uintptr_t seg = (uintptr_t) p >> MP_SEGMENT_SHIFT;
+    if (seg >> (2 * MP_PAGEMAP_BITS)) return NULL;
+
+    _MP_Memory** leaf = MP_ACQUIRE_LOAD(&mp->pagemap[seg >> MP_PAGEMAP_BITS]);
+    _MP_Memory* mm = leaf ? MP_ACQUIRE_LOAD(&leaf[seg & (MP_PAGEMAP_SIZE - 1)]) : NULL;
+    if (!mm || (char*) p < mm->start ||
+        (char*) p >= mm->start + mm->commit_size)
+        return NULL;
+    return mm;
+}
+
+// c 已标记为free但尚未放入桶中, 与前后相邻的free块合并后再放入桶
+// 向前由 MP_CHUNK_PREV_FREE 与块尾找到前一块, 向后遇到末尾哨兵自然停止
+static void merge_free_chunk(_MP_Memory* mm, _MP_Chunk* c) {
+    _MP_Chunk* p;
+    while (c->head & MP_CHUNK_PREV_FREE) {
+        p = prev_chunk(c);
+        remove_free_chunk(mm, p);
+        join_free_chunks(p, c);
+        MP_STAT_ADD(&mm->pool->stats.merge_count, 1);
+        c = p;
+    }
+
+    while (MP_CHUNK_IS_FREE(p = MP_CHUNK_NEXT(c))) {
+        remove_free_chunk(mm, p);
+        join_free_chunks(c, p);
+        MP_STAT_ADD(&mm->pool->stats.merge_count, 1);
+    }
+    insert_free_chunk(mm, c);
+}
+
+static _MP_Chunk* alloc_chunk(MemoryPool* mp, _MP_Memory* mm, mem_size_t need) {
+    if (mp->policy == MP_POLICY_BUDDY) return buddy_alloc_chunk(mm, need);
+    return first_fit_alloc_chunk(mm, need);
+}
+
+static void free_chunk(MemoryPool* mp, _MP_Memory* mm, _MP_Chunk* ck) {
+    ck->head |= MP_CHUNK_FREE;
+    if (mp->policy == MP_POLICY_BUDDY)
+        buddy_free_chunk(mm, ck);
+    else
+        merge_free_chunk(mm, ck);
+}
+
+// 需持有锁. 延迟提交模式下提交已提交部分之后的内存, 至少 MP_SEGMENT_SIZE(大页模式下为大页)
+// 与末尾的free块合并后可容纳 need 字节的块. 新块从原哨兵处开始, 哨兵移到新的末尾
+static int commit_memory(MemoryPool* mp, _MP_Memory* mm, mem_size_t need) {
+    char* top = mm->start + mm->commit_size;
+    char* limit = mm->start + mm->mempool_size;
+    _MP_Chunk* ck = memory_fence(mm);
+    mem_size_t prev_free = ck->head & MP_CHUNK_PREV_FREE;
+    if (prev_free) {
+        mem_size_t last = MP_CHUNK_SIZE(prev_chunk(ck));
+        need -= need < last ? need : last;
+    }
+
+    uintptr_t unit = page_unit(mp) > MP_SEGMENT_SIZE ? page_unit(mp) : MP_SEGMENT_SIZE;
+    char* end = (char*) (((uintptr_t) top + need + unit - 1) & ~(unit - 1));
+    if (end > limit) end = limit;
+    if (end < top + need || end < top + MP_CHUNK_MIN(mp) || os_commit(top, end - top)) return 0;
+
+    mm->commit_size += end - top;
+    init_free_chunk(ck, (char*) memory_fence(mm) - (char*) ck, 1);
+    ck->head |= prev_free;
+    memory_fence(mm)->head = 0;
+    MP_ATOMIC_ADD(&mp->alloc_mempool_size, end - top);
+    MP_STAT_ADD(&mp->stats.extend_count, 1);
+    merge_free_chunk(mm, ck);
+    return 1;
+}
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+// 分片的内存块在所属内存池上预先计入, 所有分片加和不超过总上限
+static int reserve_mempool_size(MemoryPool* top, mem_size_t sz) {
+    mem_size_t used = MP_ATOMIC_LOAD(&top->alloc_mempool_size);
+    do {
+        if (used + sz > top->max_mempool_size) return 1;
+    } while (!__atomic_compare_exchange_n(&top->alloc_mempool_size, &used, used + sz, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+#endif
+
+// 需持有锁. 自动扩展一个内存块, 超过总内存限制返回NULL
+static _MP_Memory* auto_extend_locked(MemoryPool* mp, mem_size_t total_needed_size) {
+    if (!mp->auto_extend) return NULL;
+    mem_size_t used = mp->alloc_mempool_size;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->parent) used = MP_ATOMIC_LOAD(&mp->parent->alloc_mempool_size);
+#endif
+    // 超过总内存限制
+    if (used + total_needed_size > mp->max_mempool_size) {
+        return NULL;
+    }
+    // 剩余可新增内存池大小
+    mem_size_t add_mem_sz = mp->max_mempool_size - used;
+    // 如果空间足够则按 mempool_size 新增, 不足则分配剩下所有内存
+    add_mem_sz = memory_block_size(mp, add_mem_sz >= mp->mempool_size ? mp->mempool_size : add_mem_sz,
+                                   mp->max_mempool_size - used);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->parent && reserve_mempool_size(mp->parent, add_mem_sz)) return NULL;
+#endif
+    _MP_Memory* mm = extend_memory_list(mp, add_mem_sz, add_mem_sz);
+    if (mm) MP_STAT_ADD(&mp->stats.extend_count, 1);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    else if (mp->parent)
+        MP_ATOMIC_SUB(&mp->parent->alloc_mempool_size, add_mem_sz);
+#endif
+    return mm;
+}
+
+/*
+ *  大对象: 不小于 large_threshold 的申请直接映射独占的内存区域, 不经过free桶, 不会切碎内存块
+ *  区域开头是 _MP_Memory 头部(地址索引找到的就是它), 之后是唯一的块, 数据区按页对齐
+ *  大对象挂在 large_list 上, 计入总上限, 释放时立即归还系统
+ */
+
+// 头部大小, 使块的数据区按页对齐
+static inline mem_size_t large_head_size(void) {
+    return ((sizeof(_MP_Memory) + MP_CHUNKHEADER + page_size() - 1) & ~(page_size() - 1)) - MP_CHUNKHEADER;
+}
+
+// 容纳 wantsize 的块大小, 块末尾与映射末尾对齐; 溢出返回0
+static mem_size_t large_chunk_size(mem_size_t wantsize) {
+    mem_size_t head = large_head_size();
+    if (wantsize > ((mem_size_t) -1 >> 1)) return 0;
+    return ((head + MP_CHUNKHEADER + wantsize + page_size() - 1) & ~(page_size() - 1)) - head;
+}
+
+// 需持有锁. 计入总上限, 超过返回1
+static int large_reserve_locked(MemoryPool* mp, mem_size_t sz) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->parent ? reserve_mempool_size(mp->parent, sz) != 0
+                   : mp->alloc_mempool_size + sz > mp->max_mempool_size)
+        return 1;
+#else
+    if (mp->alloc_mempool_size + sz > mp->max_mempool_size) return 1;
+#endif
+    MP_ATOMIC_ADD(&mp->alloc_mempool_size, sz);
+    return 0;
+}
+
+static void large_unreserve(MemoryPool* mp, mem_size_t sz) {
+    MP_ATOMIC_SUB(&mp->alloc_mempool_size, sz);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->parent) MP_ATOMIC_SUB(&mp->parent->alloc_mempool_size, sz);
+#endif
+}
+
+// 已分配大小变化 diff(可为负)
+static void large_stat_add(MemoryPool* mp, mem_size_t diff) {
+    MP_ATOMIC_ADD(&mp->stats.used_mem, diff);
+    MP_ATOMIC_ADD(&mp->stats.prog_mem, diff);
+    MP_ATOMIC_ADD(&mp->stats.large_mem, diff);
+}
+
+// 需持有锁. 超过总上限或系统内存不足返回NULL
+static _MP_Chunk* large_alloc_locked(MemoryPool* mp, mem_size_t wantsize) {
+    mem_size_t head = large_head_size(), sz = large_chunk_size(wantsize);
+    if (!sz || large_reserve_locked(mp, sz)) return NULL;
+
+    char* s = (char*) os_alloc(head + sz, MP_SEGMENT_SIZE, 1);
+    _MP_Memory* mm = (_MP_Memory*) s;
+    if (s) {
+        mm->pool = mp;
+        mm->huge = MP_HUGE_NONE;
+        mm->large = 1;
+        mm->start = s + head;
+        mm->mempool_size = mm->commit_size = sz;
+        if (pagemap_set(mp, mm, mm)) {
+            pagemap_set(mp, mm, NULL);
+            os_free(s, head + sz);
+            s = NULL;
+        }
+    }
+    if (!s) {
+        large_unreserve(mp, sz);
+        return NULL;
+    }
+
+    mm->id = mp->last_id++;
+    mm->alloc_mem = sz;
+    mm->alloc_prog_mem = sz - MP_CHUNKHEADER;
+    mm->alloc_chunks = 1;
+    MP_DLINKLIST_INS_FRT(mp->large_list, mm);
+    _MP_Chunk* ck = (_MP_Chunk*) mm->start;
+    ck->head = sz;
+
+    large_stat_add(mp, sz);
+    MP_ATOMIC_SUB(&mp->stats.prog_mem, MP_CHUNKHEADER);
+    MP_ATOMIC_ADD(&mp->stats.alloc_chunks, 1);
+    MP_ATOMIC_ADD(&mp->stats.large_chunks, 1);
+    MP_STAT_ADD(&mp->stats.alloc_hist[bin_index(sz)], 1);
+    return ck;
+}
+
+// 需持有锁. 从链表与地址索引中移除, 返回映射大小, 由调用者在释放锁之后解除映射
+static mem_size_t large_unlink_locked(MemoryPool* mp, _MP_Memory* mm) {
+    MP_DLINKLIST_DEL(mp->large_list, mm);
+    pagemap_set(mp, mm, NULL);
+    large_unreserve(mp, mm->mempool_size);
+    large_stat_add(mp, -mm->mempool_size);
+    MP_ATOMIC_ADD(&mp->stats.prog_mem, MP_CHUNKHEADER);
+    MP_ATOMIC_SUB(&mp->stats.alloc_chunks, 1);
+    MP_ATOMIC_SUB(&mp->stats.large_chunks, 1);
+    return large_head_size() + mm->mempool_size;
+}
+
+// 需持有锁. 释放所有大对象
+static void large_free_all_locked(MemoryPool* mp) {
+    _MP_Memory* mm = NULL;
+    mem_size_t map_sz = 0;
+    while ((mm = mp->large_list)) {
+        map_sz = large_unlink_locked(mp, mm);
+        os_free(mm, map_sz);
+    }
+}
+
+// 原地改变大对象的映射大小(mremap 不移动), 失败返回1
+static int large_resize_locked(MemoryPool* mp, _MP_Memory* mm, mem_size_t sz) {
+#ifdef MREMAP_MAYMOVE
+    mem_size_t head = large_head_size(), old = mm->mempool_size;
+    if (sz == old) return 0;
+    if (sz > old && large_reserve_locked(mp, sz - old)) return 1;
+    if (mremap(mm, head + old, head + sz, 0) == MAP_FAILED) {
+        if (sz > old) large_unreserve(mp, sz - old);
+        return 1;
+    }
+    // 地址索引: 缩小时先清掉原范围, 扩大时新范围的叶子节点可能申请失败, 退回原大小
+    if (sz < old) pagemap_set(mp, mm, NULL);
+    mm->mempool_size = mm->commit_size = sz;
+    if (pagemap_set(mp, mm, mm)) {
+        pagemap_set(mp, mm, NULL);
+        mremap(mm, head + sz, head + old, 0);
+        mm->mempool_size = mm->commit_size = old;
+        pagemap_set(mp, mm, mm);  // 原范围的叶子节点都已存在, 不会失败
+        large_unreserve(mp, sz - old);
+        return 1;
+    }
+    if (sz < old) large_unreserve(mp, old - sz);
+    ((_MP_Chunk*) mm->start)->head = sz;
+    mm->alloc_mem = sz;
+    mm->alloc_prog_mem = sz - MP_CHUNKHEADER;
+    large_stat_add(mp, sz - old);
+    return 0;
+#else
+    (void) mp;
+    (void) mm;
+    (void) sz;
+    return 1;
+#endif
+}
+
+/*
+ *  区域模式: 在当前内存块(mp->region)中移动指针分配, 单个块不回收,
+ *  通过 MemoryPoolRewind 回退到保存点整体释放. 内存块按 id 顺序使用, id 大于当前内存块的都是空的
+ */
+
+// 当前内存块之后第一个放得下 need 字节的内存块, 没有则自动扩展
+static _MP_Memory* region_next_memory(MemoryPool* mp, mem_size_t need) {
+    _MP_Memory *mm = NULL, *next = NULL;
+    for (mm = mp->mlist; mm; mm = mm->next)
+        if ((!mp->region || mm->id > mp->region->id) && mm->commit_size >= need &&
+            (!next || mm->id < next->id))
+            next = mm;
+    if (!next && (next = auto_extend_locked(mp, need)) && next->commit_size < need) next = NULL;
+    return next;
+}
+
+// 数据区按 align 对齐需要跳过的字节数
+static inline mem_size_t region_pad(_MP_Memory* mm, mem_size_t align) {
+    return (align - (((uintptr_t) mm->start + mm->alloc_mem + MP_CHUNKHEADER) & (align - 1))) &
+           (align - 1);
+}
+
+// 需持有锁. 块只有块头, 对齐跳过的部分计入 used_mem
+static _MP_Chunk* region_alloc_locked(MemoryPool* mp, mem_size_t need, mem_size_t align) {
+    _MP_Memory* mm = mp->region;
+    mem_size_t pad = mm ? region_pad(mm, align) : 0;
+    if (!mm || mm->commit_size - mm->alloc_mem < pad + need) {
+        if (!(mm = region_next_memory(mp, need + align - sizeof(long)))) return NULL;
+        mp->region = mm;
+        pad = region_pad(mm, align);
+    }
+
+    // 对齐跳过的部分写一个free块头, 以便堆遍历
+    if (pad) ((_MP_Chunk*) (mm->start + mm->alloc_mem))->head = pad | MP_CHUNK_FREE;
+    _MP_Chunk* ck = (_MP_Chunk*) (mm->start + mm->alloc_mem + pad);
+    ck->head = need;
+    mm->alloc_mem += pad + need;
+    mm->alloc_prog_mem += need - MP_CHUNKHEADER;
+    mm->alloc_chunks++;
+    MP_ATOMIC_ADD(&mp->stats.used_mem, pad + need);
+    MP_ATOMIC_ADD(&mp->stats.prog_mem, need - MP_CHUNKHEADER);
+    MP_ATOMIC_ADD(&mp->stats.alloc_chunks, 1);
+    MP_STAT_ADD(&mp->stats.alloc_hist[bin_index(need)], 1);
+    return ck;
+}
+
+// 需持有锁. 当前内存块中最后分配的块可原地扩大, 其余只能原地缩小(多出的部分不回收), 不满足返回1
+static int region_resize_locked(MemoryPool* mp, _MP_Memory* mm, _MP_Chunk* ck, mem_size_t need) {
+    mem_size_t sz = MP_CHUNK_SIZE(ck);
+    if (need <= sz) return 0;
+    if (mm != mp->region || (char*) ck + sz != mm->start + mm->alloc_mem ||
+        need - sz > mm->commit_size - mm->alloc_mem)
+        return 1;
+
+    ck->head = need;
+    mm->alloc_mem += need - sz;
+    mm->alloc_prog_mem += need - sz;
+    MP_ATOMIC_ADD(&mp->stats.used_mem, need - sz);
+    MP_ATOMIC_ADD(&mp->stats.prog_mem, need - sz);
+    return 0;
+}
+
+// 需持有锁. 将内存块的分配状态回退到保存点
+static void region_reset(MemoryPool* mp, _MP_Memory* mm, mem_size_t alloc_mem,
+                         mem_size_t alloc_prog_mem, mem_size_t alloc_chunks) {
+    MP_ATOMIC_SUB(&mp->stats.used_mem, mm->alloc_mem - alloc_mem);
+    MP_ATOMIC_SUB(&mp->stats.prog_mem, mm->alloc_prog_mem - alloc_prog_mem);
+    MP_ATOMIC_SUB(&mp->stats.alloc_chunks, mm->alloc_chunks - alloc_chunks);
+    mm->alloc_mem = alloc_mem;
+    mm->alloc_prog_mem = alloc_prog_mem;
+    mm->alloc_chunks = alloc_chunks;
+}
+
+// 需持有锁. 块立即还回free桶并与相邻free块合并
+static void merge_chunk_locked(MemoryPool* mp, _MP_Memory* mm, _MP_Chunk* ck) {
+    ck->head &= ~(mem_size_t) MP_CHUNK_ZERO;
+    mm->alloc_chunks--;
+
+    mm->alloc_mem -= MP_CHUNK_SIZE(ck);
+    mm->alloc_prog_mem -= MP_CHUNK_PROG_SIZE(ck);
+    MP_ATOMIC_SUB(&mp->stats.used_mem, MP_CHUNK_SIZE(ck));
+    MP_ATOMIC_SUB(&mp->stats.prog_mem, MP_CHUNK_PROG_SIZE(ck));
+    MP_ATOMIC_SUB(&mp->stats.alloc_chunks, 1);
+
+    free_chunk(mp, mm, ck);
+}
+
+/*
+ *  快速复用桶: 延迟合并模式下刚释放的小块按大小精确分类挂在内存池上, 同样大小的申请直接取回
+ *  桶中的块对内存块而言仍是已分配块, 不修改相邻块的标志, 链表指针与线程缓存一样存放在数据区
+ */
+
+#define MP_FAST_CLASS(sz) ((sz) / sizeof(long))
+#define MP_FAST_NEXT(ck) (*(_MP_Chunk**) ((char*) (ck) + MP_CHUNKHEADER))
+
+// 需持有锁. 返回合并的字节数
+static mem_size_t fast_merge_locked(MemoryPool* mp) {
+    mem_size_t merged = mp->fast_mem;
+    unsigned int cls;
+    _MP_Chunk* ck = NULL;
+    if (!merged) return 0;
+    for (cls = 0; cls <= MP_FAST_CLASS(MP_FAST_MAX_SIZE); cls++) {
+        while ((ck = mp->fast_bins[cls])) {
+            mp->fast_bins[cls] = MP_FAST_NEXT(ck);
+            MP_ATOMIC_ADD(&mp->stats.prog_mem, MP_CHUNK_PROG_SIZE(ck));
+            MP_ATOMIC_SUB(&mp->stats.cache_mem, MP_CHUNK_SIZE(ck));
+            merge_chunk_locked(mp, find_memory_list(mp, ck), ck);
+        }
+    }
+    mp->fast_mem = 0;
+    return merged;
+}
+
+// 桶中的块计入 cache_mem, 不计入 prog_mem; 不使用 MP_CHUNK_ZERO
+static void fast_push_locked(MemoryPool* mp, _MP_Chunk* ck) {
+    unsigned int cls = MP_FAST_CLASS(MP_CHUNK_SIZE(ck));
+    ck->head &= ~(mem_size_t) MP_CHUNK_ZERO;
+    MP_FAST_NEXT(ck) = mp->fast_bins[cls];
+    mp->fast_bins[cls] = ck;
+    mp->fast_mem += MP_CHUNK_SIZE(ck);
+    MP_ATOMIC_SUB(&mp->stats.prog_mem, MP_CHUNK_PROG_SIZE(ck));
+    MP_ATOMIC_ADD(&mp->stats.cache_mem, MP_CHUNK_SIZE(ck));
+    if (mp->fast_mem > MP_FAST_MAX_MEM) fast_merge_locked(mp);
+}
+
+static _MP_Chunk* fast_pop_locked(MemoryPool* mp, mem_size_t sz) {
+    unsigned int cls = MP_FAST_CLASS(sz);
+    _MP_Chunk* ck = mp->fast_bins[cls];
+    if (!ck) return NULL;
+    mp->fast_bins[cls] = MP_FAST_NEXT(ck);
+    mp->fast_mem -= sz;
+    MP_ATOMIC_ADD(&mp->stats.prog_mem, MP_CHUNK_PROG_SIZE(ck));
+    MP_ATOMIC_SUB(&mp->stats.cache_mem, sz);
+    MP_STAT_ADD(&mp->stats.alloc_hist[bin_index(sz)], 1);
+    return ck;
+}
+
+// 最佳适配: 所有内存块中最小的满足块所在的内存块, 大小相同时取地址低的; 都没有返回NULL
+static _MP_Memory* best_fit_memory(MemoryPool* mp, mem_size_t need) {
+    _MP_Memory *mm = NULL, *best_mm = NULL;
+    _MP_Chunk *ck = NULL, *best = NULL;
+    for (mm = mp->mlist; mm; mm = mm->next) {
+        if (mm->mempool_size - mm->alloc_mem < need || !(ck = find_free_chunk(mm, need))) continue;
+        if (!best || MP_CHUNK_SIZE(ck) < MP_CHUNK_SIZE(best) ||
+            (MP_CHUNK_SIZE(ck) == MP_CHUNK_SIZE(best) && ck < best)) {
+            best = ck;
+            best_mm = mm;
+        }
+    }
+    return best_mm;
+}
+
+// 需持有锁. 在所有内存池中查找可用块, 必要时自动扩展
+static _MP_Chunk* alloc_chunk_locked(MemoryPool* mp, mem_size_t total_needed_size) {
+    _MP_Memory* mm = NULL;
+    _MP_Chunk* ck = NULL;
+    if (mp->policy == MP_POLICY_REGION) return region_alloc_locked(mp, total_needed_size, mp->min_align);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    remote_drain_locked(mp);
+#endif
+    if (mp->defer_merge && total_needed_size <= MP_FAST_MAX_SIZE &&
+        (ck = fast_pop_locked(mp, total_needed_size)))
+        return ck;
+FIND_FREE_CHUNK:
+    // 最佳适配直接定位到全局最小的满足块, 不停在第一个有满足块的内存块
+    mm = mp->policy == MP_POLICY_BEST_FIT ? best_fit_memory(mp, total_needed_size) : mp->mlist;
+    while (mm) {
+        if (mm->mempool_size - mm->alloc_mem < total_needed_size ||
+            !(ck = alloc_chunk(mp, mm, total_needed_size))) {
+            mm = mm->next;
+            continue;
+        }
+
+        ck->head &= ~(mem_size_t) MP_CHUNK_FREE;
+        mm->alloc_chunks++;
+
+        mm->alloc_mem += MP_CHUNK_SIZE(ck);
+        mm->alloc_prog_mem += MP_CHUNK_PROG_SIZE(ck);
+        MP_ATOMIC_ADD(&mp->stats.used_mem, MP_CHUNK_SIZE(ck));
+        MP_ATOMIC_ADD(&mp->stats.prog_mem, MP_CHUNK_PROG_SIZE(ck));
+        MP_ATOMIC_ADD(&mp->stats.alloc_chunks, 1);
+        MP_STAT_ADD(&mp->stats.alloc_hist[bin_index(total_needed_size)], 1);
+        return ck;
+    }
+
+    // 合并出足够大的free块后重新查找
+    if (fast_merge_locked(mp)) goto FIND_FREE_CHUNK;
+    if (mp->lazy_commit) {
+        if (commit_memory(mp, mp->mlist, total_needed_size)) goto FIND_FREE_CHUNK;
+        return NULL;
+    }
+
+    if (auto_extend_locked(mp, total_needed_size)) goto FIND_FREE_CHUNK;
+
+    // printf("[MemoryPool_Alloc] No enough memory! \n");
+    return NULL;
+}
+
+// 需持有锁. 释放程序使用过的块, 区域模式下不回收
+static void free_chunk_locked(MemoryPool* mp, _MP_Memory* mm, _MP_Chunk* ck) {
+    if (mp->policy == MP_POLICY_REGION) return;
+    if (mp->defer_merge && MP_CHUNK_SIZE(ck) <= MP_FAST_MAX_SIZE) {
+        fast_push_locked(mp, ck);
+        return;
+    }
+    merge_chunk_locked(mp, mm, ck);
+}
+
+// 需持有锁. 已分配块尾部多出的部分足够大时切分出来还给free链表(仅非伙伴模式)
+static void shrink_chunk_locked(MemoryPool* mp, _MP_Memory* mm, _MP_Chunk* ck, mem_size_t need) {
+    mem_size_t rest_sz = MP_CHUNK_SIZE(ck) - need;
+    if (rest_sz < MP_CHUNK_MIN(mp)) return;
+
+    _MP_Chunk* rest = (_MP_Chunk*) ((char*) ck + need);
+    rest->head = rest_sz;
+    ck->head = need | (ck->head & MP_CHUNK_FLAGS);
+
+    mm->alloc_mem -= rest_sz;
+    mm->alloc_prog_mem -= rest_sz;
+    MP_ATOMIC_SUB(&mp->stats.used_mem, rest_sz);
+    MP_ATOMIC_SUB(&mp->stats.prog_mem, rest_sz);
+    MP_STAT_ADD(&mp->stats.split_count, 1);
+    free_chunk(mp, mm, rest);
+}
+
+// 需持有锁. 吸收紧随其后的free块扩大已分配块, 空间不足返回1
+static int grow_chunk_locked(MemoryPool* mp, _MP_Memory* mm, _MP_Chunk* ck, mem_size_t need) {
+    _MP_Chunk* next = MP_CHUNK_NEXT(ck);
+    if (!MP_CHUNK_IS_FREE(next) || MP_CHUNK_SIZE(ck) + MP_CHUNK_SIZE(next) < need)
+        return 1;
+
+    mem_size_t add_sz = MP_CHUNK_SIZE(next);
+    remove_free_chunk(mm, next);
+    ck->head += add_sz;
+    mark_next_chunk(mm, ck, 0);
+
+    mm->alloc_mem += add_sz;
+    mm->alloc_prog_mem += add_sz;
+    MP_ATOMIC_ADD(&mp->stats.used_mem, add_sz);
+    MP_ATOMIC_ADD(&mp->stats.prog_mem, add_sz);
+    shrink_chunk_locked(mp, mm, ck, need);
+    return 0;
+}
+
+// 需持有锁. 伙伴模式下原地调整块大小: 缩小时逐级释放后一半,
+// 扩大时要求块始终是前一半且对应的伙伴空闲, 不满足返回1
+static int buddy_resize_chunk_locked(MemoryPool* mp, _MP_Memory* mm, _MP_Chunk* ck, mem_size_t need) {
+    mem_size_t off = (char*) ck - mm->start, old = MP_CHUNK_SIZE(ck), sz = old;
+    if (need > sz) {
+        for (; sz < need; sz <<= 1) {
+            _MP_Chunk* buddy = (_MP_Chunk*) ((char*) ck + sz);
+            if ((off & sz) || off + (sz << 1) > mm->mempool_size ||
+                !MP_CHUNK_IS_FREE(buddy) || MP_CHUNK_SIZE(buddy) != sz)
+                return 1;
+        }
+        for (sz = old; sz < need; sz <<= 1)
+            remove_free_chunk(mm, (_MP_Chunk*) ((char*) ck + sz));
+    } else {
+        while ((sz >> 1) >= need) {
+            sz >>= 1;
+            _MP_Chunk* buddy = (_MP_Chunk*) ((char*) ck + sz);
+            init_free_chunk(buddy, sz, 0);
+            insert_free_chunk(mm, buddy);
+            MP_STAT_ADD(&mp->stats.split_count, 1);
+        }
+    }
+
+    if (sz > old) {
+        mm->alloc_mem += sz - old;
+        mm->alloc_prog_mem += sz - old;
+        MP_ATOMIC_ADD(&mp->stats.used_mem, sz - old);
+        MP_ATOMIC_ADD(&mp->stats.prog_mem, sz - old);
+    } else {
+        mm->alloc_mem -= old - sz;
+        mm->alloc_prog_mem -= old - sz;
+        MP_ATOMIC_SUB(&mp->stats.used_mem, old - sz);
+        MP_ATOMIC_SUB(&mp->stats.prog_mem, old - sz);
+    }
+    ck->head = sz | (ck->head & MP_CHUNK_FLAGS);
+    return 0;
+}
+
+// 需持有锁. 分配数据区按 align(2的幂) 对齐的块
+// 伙伴模式直接按 max(need, align) 分配; 其余模式多分配 align + 最小块,
+// 头部的对齐填充与尾部多余部分都切分出来还给free链表
+static _MP_Chunk* alloc_aligned_chunk_locked(MemoryPool* mp, mem_size_t need, mem_size_t align) {
+    if (align <= mp->min_align) return alloc_chunk_locked(mp, need);
+    if (mp->policy == MP_POLICY_REGION) return region_alloc_locked(mp, need, align);
+    if (mp->policy == MP_POLICY_BUDDY) {
+        if (align > MP_SEGMENT_SIZE || align > buddy_floor_size(mp->mempool_size))
+            return NULL;
+        return alloc_chunk_locked(mp, need > align ? need : align);
+    }
+
+    _MP_Chunk* ck = alloc_chunk_locked(mp, MP_ALIGN_UP(need + align + MP_CHUNK_MIN(mp), mp->min_align));
+    if (!ck) return NULL;
+    _MP_Memory* mm = find_memory_list(mp, ck);
+
+    mem_size_t lead = (align - (((uintptr_t) ck + MP_CHUNKHEADER) & (align - 1))) &
+                      (align - 1);
+    while (lead && lead < MP_CHUNK_MIN(mp)) lead += align;
+    if (lead) {
+        _MP_Chunk* aligned = (_MP_Chunk*) ((char*) ck + lead);
+        aligned->head = (MP_CHUNK_SIZE(ck) - lead) | MP_CHUNK_IS_ZERO(ck);
+        ck->head = lead | (ck->head & MP_CHUNK_FLAGS);
+        mm->alloc_mem -= lead;
+        mm->alloc_prog_mem -= lead;
+        MP_ATOMIC_SUB(&mp->stats.used_mem, lead);
+        MP_ATOMIC_SUB(&mp->stats.prog_mem, lead);
+        MP_STAT_ADD(&mp->stats.split_count, 1);
+        free_chunk(mp, mm, ck);
+        ck = aligned;
+    }
+    shrink_chunk_locked(mp, mm, ck, need);
+    return ck;
+}
+
+/*
+ *  归还内存: 释放完全空闲的扩展内存块, 大块free内存中的整页通过madvise归还系统
+ */
+
+#define MP_PURGE_MIN_SIZE (64 * KB)  // 不小于此大小的free块才归还
+
+static mem_size_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (mem_size_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// free块数据区中可整页归还的部分 [lo, hi)
+static mem_size_t purge_range(MemoryPool* mp, _MP_Chunk* ck, char** lo, char** hi) {
+    uintptr_t mask = ~(uintptr_t) (page_unit(mp) - 1);
+    *lo = (char*) (((uintptr_t) ck + MP_FREE_META + page_unit(mp) - 1) & mask);
+    *hi = (char*) (((uintptr_t) ck + MP_CHUNK_SIZE(ck) - MP_CHUNKEND) & mask);
+    return *hi > *lo ? *hi - *lo : 0;
+}
+
+// 归还后整页内容为0, 顺便清零两端不足一页的部分, 使整块都可被calloc直接使用
+static void purge_chunk(MemoryPool* mp, _MP_Chunk* ck) {
+    char *lo, *hi;
+    mem_size_t sz = purge_range(mp, ck, &lo, &hi);
+    if (!sz || madvise(lo, sz, MADV_DONTNEED)) return;
+    if (!MP_CHUNK_IS_ZERO(ck)) {
+        memset((char*) ck + MP_FREE_META, 0, lo - ((char*) ck + MP_FREE_META));
+        memset(hi, 0, (char*) ck + MP_CHUNK_SIZE(ck) - MP_CHUNKEND - hi);
+        ck->head |= MP_CHUNK_ZERO;
+    }
+    MP_CHUNK_FOOT(ck) = MP_CHUNK_SIZE(ck) | MP_PURGE_DONE;
+    MP_ATOMIC_ADD(&mp->stats.purged_mem, sz);
+}
+
+// 衰减模式下只归还上一次检查时就已空闲的内存, 其余的标记为 MP_PURGE_IDLE 留待下一次
+static int purge_ready(_MP_Chunk* ck, int decay) {
+    if (!decay || MP_CHUNK_PURGE(ck) != MP_PURGE_NONE) return 1;
+    MP_CHUNK_FOOT(ck) = MP_CHUNK_SIZE(ck) | MP_PURGE_IDLE;
+    return 0;
+}
+
+// 空闲内存块中的free块是否都可以归还
+static int memory_idle(_MP_Memory* mm, int decay) {
+    int i, idle = 1;
+    _MP_Chunk* ck = NULL;
+    for (i = 0; i < MP_BIN_COUNT; i++)
+        for (ck = mm->free_bins[i]; ck; ck = ck->next)
+            if (!purge_ready(ck, decay)) idle = 0;
+    return idle;
+}
+
+static void release_memory(MemoryPool* mp, _MP_Memory* mm) {
+    int i;
+    for (i = 0; i < MP_BIN_COUNT; i++)
+        while (mm->free_bins[i]) remove_free_chunk(mm, mm->free_bins[i]);
+    pagemap_set(mp, mm, NULL);
+    MP_ATOMIC_SUB(&mp->alloc_mempool_size, mm->commit_size);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->parent) MP_ATOMIC_SUB(&mp->parent->alloc_mempool_size, mm->commit_size);
+#endif
+    MP_ATOMIC_SUB(&mp->stats.block_count, 1);
+    os_free(mm, memory_map_size(mp, mm));
+}
+
+// 延迟提交模式下末尾的大块free内存撤销提交, 只保留一个最小块与哨兵
+static void decommit_memory(MemoryPool* mp, _MP_Memory* mm, int decay) {
+    char* top = mm->start + mm->commit_size;
+    _MP_Chunk* fence = memory_fence(mm);
+    if (!(fence->head & MP_CHUNK_PREV_FREE)) return;
+    _MP_Chunk* ck = prev_chunk(fence);
+    if (MP_CHUNK_SIZE(ck) < MP_PURGE_MIN_SIZE || !purge_ready(ck, decay)) return;
+
+    char* keep = (char*) (((uintptr_t) ck + MP_CHUNK_MIN(mp) + MP_CHUNKHEADER + page_unit(mp) - 1) &
+                          ~(uintptr_t) (page_unit(mp) - 1));
+    if (keep >= top) return;
+    // 块尾位于将要撤销提交的部分, 先移出桶
+    remove_free_chunk(mm, ck);
+    if (os_decommit(keep, top - keep)) {
+        insert_free_chunk(mm, ck);
+        return;
+    }
+    mm->commit_size -= top - keep;
+    MP_ATOMIC_SUB(&mp->alloc_mempool_size, top - keep);
+    init_free_chunk(ck, (char*) memory_fence(mm) - (char*) ck, MP_CHUNK_IS_ZERO(ck));
+    memory_fence(mm)->head = 0;
+    insert_free_chunk(mm, ck);
+}
+
+// 需持有锁. 最早的内存块(链表尾)始终保留, 返回实际占用内存减少的字节数
+static mem_size_t trim_locked(MemoryPool* mp, int decay) {
+    // 桶中的块占着内存块, 先合并才能释放空闲的内存块与整页
+    fast_merge_locked(mp);
+    // 共享文件映射 madvise 后内容不会变为0, 持久化内存池不归还
+    if (mp->file_size) return 0;
+    mem_size_t committed = mp->alloc_mempool_size - mp->stats.purged_mem;
+    _MP_Memory **pm = &mp->mlist, *mm = NULL;
+    _MP_Chunk* ck = NULL;
+    unsigned int i;
+    while ((mm = *pm)) {
+        // 区域模式下保存点可能指向当前内存块之前的空内存块, 只释放之后的
+        if (mm->next && mm->alloc_mem == 0 && memory_idle(mm, decay) &&
+            (mp->policy != MP_POLICY_REGION || !mp->region || mm->id > mp->region->id)) {
+            *pm = mm->next;
+            release_memory(mp, mm);
+            continue;
+        }
+        if (mp->lazy_commit) decommit_memory(mp, mm, decay);
+        for (i = bin_index(MP_PURGE_MIN_SIZE); i < MP_BIN_COUNT; i++)
+            for (ck = mm->free_bins[i]; ck; ck = ck->next)
+                if (MP_CHUNK_SIZE(ck) >= MP_PURGE_MIN_SIZE && MP_CHUNK_PURGE(ck) != MP_PURGE_DONE &&
+                    purge_ready(ck, decay))
+                    purge_chunk(mp, ck);
+        pm = &mm->next;
+    }
+    return committed - (mp->alloc_mempool_size - mp->stats.purged_mem);
+}
+
+// 需持有锁. 释放路径上调用, 每个周期最多检查一次
+static void decay_locked(MemoryPool* mp) {
+    if (!mp->decay_ms) return;
+    mem_size_t now = now_ms();
+    if (now - mp->last_decay < mp->decay_ms) return;
+    mp->last_decay = now;
+    trim_locked(mp, 1);
+}
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+/*
+ *  线程缓存: 按块大小(sizeof(long)粒度)缓存本线程最近释放的小块
+ *  缓存中的块对内存池而言仍处于已分配状态, 批量与内存池交换以减少加锁次数
+ */
+
+#define MP_TCACHE_CLASS(sz) ((sz) / sizeof(long))
+#define MP_TCACHE_SIZE(cls) ((mem_size_t) (cls) * sizeof(long))
+// 缓存中的块对内存池而言仍是已分配块, 缓存链表指针存放在数据区
+#define MP_TCACHE_NEXT(ck) (*(_MP_Chunk**) ((char*) (ck) + MP_CHUNKHEADER))
+
+struct _mp_thread_cache {
+    MemoryPool* mp;
+    unsigned int gen;
+    _MP_Chunk* bins[MP_TCACHE_CLASS(MP_TCACHE_MAX_SIZE) + 1];
+    unsigned int counts[MP_TCACHE_CLASS(MP_TCACHE_MAX_SIZE) + 1];
+    unsigned int hits[MP_TCACHE_CLASS(MP_TCACHE_MAX_SIZE) + 1];  // 尚未计入 alloc_hist 的命中次数
+    struct _mp_thread_cache *prev, *next;
+};
+
+/*
+ *  线程私有数据: 整个进程只创建一个 pthread key, 不受 PTHREAD_KEYS_MAX 限制内存池个数
+ *  每个内存池创建时取得一个槽位, 每个线程一张按槽位下标的表, 存放本线程在该内存池的线程缓存
+ *  (分片的外层内存池存放本线程所用分片的下标)
+ *  槽位在内存池销毁后复用, 表项带有取得槽位时的序号, 序号不符的表项视为空
+ */
+
+typedef struct _mp_thread_slot {
+    mem_size_t seq;
+    void* val;
+} _MP_ThreadSlot;
+
+typedef struct _mp_thread_table {
+    unsigned int cap;
+    _MP_ThreadSlot* slots;
+} _MP_ThreadTable;
+
+static pthread_key_t mp_thread_key;
+static pthread_once_t mp_thread_once = PTHREAD_ONCE_INIT;
+static int mp_thread_key_err = 0;
+// 槽位 -> 内存池, NULL为空闲; 创建销毁内存池与线程退出时持有, 之后才能加内存池的锁
+static pthread_mutex_t mp_slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static MemoryPool** mp_slot_pools = NULL;
+static unsigned int mp_slot_cap = 0;
+static mem_size_t mp_slot_seq = 0;
+
+static void tcache_destructor(void* arg);
+
+// 线程退出时归还本线程在仍然存在的内存池中的缓存
+static void thread_table_destructor(void* arg) {
+    _MP_ThreadTable* t = (_MP_ThreadTable*) arg;
+    unsigned int i;
+    pthread_mutex_lock(&mp_slot_lock);
+    for (i = 0; i < t->cap && i < mp_slot_cap; i++) {
+        MemoryPool* mp = mp_slot_pools[i];
+        if (mp && !mp->arenas && t->slots[i].val && t->slots[i].seq == mp->slot_seq)
+            tcache_destructor(t->slots[i].val);
+    }
+    pthread_mutex_unlock(&mp_slot_lock);
+    free(t->slots);
+    free(t);
+}
+
+static void thread_key_init(void) {
+    mp_thread_key_err = pthread_key_create(&mp_thread_key, thread_table_destructor);
+}
+
+// 取得空闲槽位, 失败返回1
+static int slot_acquire(MemoryPool* mp) {
+    unsigned int i;
+    pthread_once(&mp_thread_once, thread_key_init);
+    if (mp_thread_key_err) return 1;
+    pthread_mutex_lock(&mp_slot_lock);
+    for (i = 0; i < mp_slot_cap && mp_slot_pools[i]; i++) {}
+    if (i == mp_slot_cap) {
+        unsigned int cap = mp_slot_cap ? mp_slot_cap * 2 : 16;
+        MemoryPool** pools = (MemoryPool**) realloc(mp_slot_pools, cap * sizeof(MemoryPool*));
+        if (!pools) {
+            pthread_mutex_unlock(&mp_slot_lock);
+            return 1;
+        }
+        memset(pools + mp_slot_cap, 0, (cap - mp_slot_cap) * sizeof(MemoryPool*));
+        mp_slot_pools = pools;
+        mp_slot_cap = cap;
+    }
+    mp_slot_pools[i] = mp;
+    mp->slot = i;
+    mp->slot_seq = ++mp_slot_seq;
+    pthread_mutex_unlock(&mp_slot_lock);
+    return 0;
+}
+
+// 之后线程退出时不再访问该内存池, 需在释放线程缓存之前调用
+static void slot_release(MemoryPool* mp) {
+    pthread_mutex_lock(&mp_slot_lock);
+    mp_slot_pools[mp->slot] = NULL;
+    pthread_mutex_unlock(&mp_slot_lock);
+}
+
+static void* thread_get(MemoryPool* mp) {
+    _MP_ThreadTable* t = (_MP_ThreadTable*) pthread_getspecific(mp_thread_key);
+    if (!t || mp->slot >= t->cap || t->slots[mp->slot].seq != mp->slot_seq) return NULL;
+    return t->slots[mp->slot].val;
+}
+
+// 表不够大时扩大到能容纳 mp 的槽位, 失败返回1
+static int thread_set(MemoryPool* mp, void* val) {
+    _MP_ThreadTable* t = (_MP_ThreadTable*) pthread_getspecific(mp_thread_key);
+    if (!t) {
+        if (!(t = (_MP_ThreadTable*) calloc(1, sizeof(_MP_ThreadTable)))) return 1;
+        if (pthread_setspecific(mp_thread_key, t)) {
+            free(t);
+            return 1;
+        }
+    }
+    if (mp->slot >= t->cap) {
+        unsigned int cap = t->cap ? t->cap : 16;
+        while (cap <= mp->slot) cap *= 2;
+        _MP_ThreadSlot* slots = (_MP_ThreadSlot*) realloc(t->slots, cap * sizeof(_MP_ThreadSlot));
+        if (!slots) return 1;
+        memset(slots + t->cap, 0, (cap - t->cap) * sizeof(_MP_ThreadSlot));
+        t->slots = slots;
+        t->cap = cap;
+    }
+    t->slots[mp->slot].seq = mp->slot_seq;
+    t->slots[mp->slot].val = val;
+    return 0;
+}
+
+// 缓存中的块计入 cache_mem, 不计入 prog_mem
+// 不加锁时不能修改块头, 块大小由 cls 得到; 缓存中的块不使用 MP_CHUNK_ZERO
+static inline void tcache_push(_MP_ThreadCache* tc, unsigned int cls, _MP_Chunk* ck) {
+    MP_TCACHE_NEXT(ck) = tc->bins[cls];
+    tc->bins[cls] = ck;
+    tc->counts[cls]++;
+    MP_ATOMIC_SUB(&tc->mp->stats.prog_mem, MP_TCACHE_SIZE(cls) - MP_CHUNKHEADER);
+    MP_ATOMIC_ADD(&tc->mp->stats.cache_mem, MP_TCACHE_SIZE(cls));
+}
+
+static inline _MP_Chunk* tcache_pop(_MP_ThreadCache* tc, unsigned int cls) {
+    _MP_Chunk* ck = tc->bins[cls];
+    tc->bins[cls] = MP_TCACHE_NEXT(ck);
+    tc->counts[cls]--;
+    MP_ATOMIC_ADD(&tc->mp->stats.prog_mem, MP_TCACHE_SIZE(cls) - MP_CHUNKHEADER);
+    MP_ATOMIC_SUB(&tc->mp->stats.cache_mem, MP_TCACHE_SIZE(cls));
+    return ck;
+}
+
+static void tcache_reset(_MP_ThreadCache* tc) {
+    memset(tc->bins, 0, sizeof(tc->bins));
+    memset(tc->counts, 0, sizeof(tc->counts));
+    tc->gen = tc->mp->tcache_gen;
+}
+
+// 需持有锁. 命中次数不加锁累计在线程内, 加锁时计入 alloc_hist
+static void tcache_fold_hits_locked(_MP_ThreadCache* tc) {
+    unsigned int cls;
+    for (cls = 0; cls <= MP_TCACHE_CLASS(MP_TCACHE_MAX_SIZE); cls++) {
+        if (!tc->hits[cls]) continue;
+        MP_STAT_ADD(&tc->mp->stats.alloc_hist[bin_index(MP_TCACHE_SIZE(cls))], tc->hits[cls]);
+        tc->hits[cls] = 0;
+    }
+}
+
+// 需持有锁. 将 cls 桶中最多 n 个块归还内存池
+static void tcache_flush_bin_locked(_MP_ThreadCache* tc, unsigned int cls, unsigned int n) {
+    while (n-- && tc->bins[cls]) {
+        _MP_Chunk* ck = tcache_pop(tc, cls);
+        free_chunk_locked(tc->mp, find_memory_list(tc->mp, ck), ck);
+    }
+}
+
+// 需持有锁
+static void tcache_flush_locked(_MP_ThreadCache* tc) {
+    unsigned int cls;
+    tcache_fold_hits_locked(tc);
+    if (tc->gen != tc->mp->tcache_gen) {
+        tcache_reset(tc);
+        return;
+    }
+    for (cls = 0; cls <= MP_TCACHE_CLASS(MP_TCACHE_MAX_SIZE); cls++)
+        tcache_flush_bin_locked(tc, cls, tc->counts[cls]);
+}
+
+// 线程退出时归还缓存
+static void tcache_destructor(void* arg) {
+    _MP_ThreadCache* tc = (_MP_ThreadCache*) arg;
+    MemoryPool* mp = tc->mp;
+    MP_LOCK(mp);
+    tcache_flush_locked(tc);
+    MP_DLINKLIST_DEL(mp->tcache_list, tc);
+    MP_UNLOCK(mp);
+    free(tc);
+}
+
+static _MP_ThreadCache* get_thread_cache(MemoryPool* mp) {
+    if (mp->policy == MP_POLICY_REGION) return NULL;
+    _MP_ThreadCache* tc = (_MP_ThreadCache*) thread_get(mp);
+    if (tc) {
+        if (tc->gen != mp->tcache_gen) tcache_reset(tc);
+        return tc;
+    }
+
+    tc = (_MP_ThreadCache*) malloc(sizeof(_MP_ThreadCache));
+    if (!tc) return NULL;
+    tc->mp = mp;
+    memset(tc->hits, 0, sizeof(tc->hits));
+    MP_LOCK(mp);
+    tcache_reset(tc);
+    MP_DLINKLIST_INS_FRT(mp->tcache_list, tc);
+    MP_UNLOCK(mp);
+    if (thread_set(mp, tc)) {
+        MP_LOCK(mp);
+        MP_DLINKLIST_DEL(mp->tcache_list, tc);
+        MP_UNLOCK(mp);
+        free(tc);
+        return NULL;
+    }
+    return tc;
+}
+
+// 缓存为空时加一次锁批量填充. 填充的块不计入 alloc_hist, 从缓存取出时才计数
+static _MP_Chunk* tcache_get(MemoryPool* mp, mem_size_t total_needed_size) {
+    _MP_ThreadCache* tc = get_thread_cache(mp);
+    if (!tc) return NULL;
+
+    unsigned int cls = MP_TCACHE_CLASS(total_needed_size), n;
+    _MP_Chunk* ck = tc->bins[cls];
+    if (!ck) {
+        MP_LOCK(mp);
+        for (n = 0; n < MP_TCACHE_BATCH; n++) {
+            if (!(ck = alloc_chunk_locked(mp, total_needed_size))) break;
+            MP_STAT_ADD(&mp->stats.alloc_hist[bin_index(total_needed_size)], -1);
+            tcache_push(tc, cls, ck);
+        }
+        tcache_fold_hits_locked(tc);
+        MP_UNLOCK(mp);
+        if (!tc->bins[cls]) return NULL;
+    }
+    tc->hits[cls]++;
+    return tcache_pop(tc, cls);
+}
+
+/*
+ *  延迟释放: 释放时锁被占用, 则用一次CAS将块压入内存池的无锁栈后直接返回,
+ *  之后持有锁分配(或释放, 归还内存)的线程整批取出释放, 合并仍在锁内进行
+ *  栈中的块对内存池而言仍是已分配块, 链表指针与线程缓存一样存放在数据区
+ */
+
+// 压入 first..last 一串已用 MP_TCACHE_NEXT 连好的块
+static void remote_push(MemoryPool* mp, _MP_Chunk* first, _MP_Chunk* last) {
+    _MP_Chunk* head = __atomic_load_n(&mp->remote_free, __ATOMIC_RELAXED);
+    do {
+        MP_TCACHE_NEXT(last) = head;
+    } while (!__atomic_compare_exchange_n(&mp->remote_free, &head, first, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// 需持有锁
+static void remote_drain_locked(MemoryPool* mp) {
+    if (!__atomic_load_n(&mp->remote_free, __ATOMIC_RELAXED)) return;
+    _MP_Chunk *ck = __atomic_exchange_n(&mp->remote_free, NULL, __ATOMIC_ACQUIRE), *next = NULL;
+    for (; ck; ck = next) {
+        next = MP_TCACHE_NEXT(ck);
+        free_chunk_locked(mp, find_memory_list(mp, ck), ck);
+        MP_STAT_ADD(&mp->stats.remote_frees, 1);
+    }
+}
+
+// 缓存已满时批量归还, 锁被占用则整串压入延迟释放栈
+static int tcache_put(MemoryPool* mp, _MP_Chunk* ck, mem_size_t sz) {
+    _MP_ThreadCache* tc = get_thread_cache(mp);
+    if (!tc) return 0;
+
+    unsigned int cls = MP_TCACHE_CLASS(sz), n;
+    if (tc->counts[cls] >= MP_TCACHE_MAX_COUNT) {
+        if (MP_TRYLOCK(mp)) {
+            tcache_fold_hits_locked(tc);
+            tcache_flush_bin_locked(tc, cls, MP_TCACHE_BATCH);
+            MP_UNLOCK(mp);
+        } else {
+            _MP_Chunk *first = tc->bins[cls], *last = NULL;
+            for (n = 0; n < MP_TCACHE_BATCH; n++) last = tcache_pop(tc, cls);
+            remote_push(mp, first, last);
+        }
+    }
+    tcache_push(tc, cls, ck);
+    return 1;
+}
+#endif
+
+MemoryPool* MemoryPoolInit(mem_size_t max_mempool_size, mem_size_t mempool_size) {
+    MemoryPoolOptions opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.max_mempool_size = max_mempool_size;
+    opt.mempool_size = mempool_size;
+    opt.policy = MP_POLICY_FIRST_FIT;
+    return MemoryPoolInitEx(&opt);
+}
+
+// 参数与统计的初始值, 不分配内存
+static void init_pool(MemoryPool* mp, const MemoryPoolOptions* opt) {
+    mp->last_id = 0;
+    mp->policy = opt->policy;
+    mp->min_align = opt->min_align > sizeof(long) ? opt->min_align : sizeof(long);
+    mp->lazy_commit = opt->lazy_commit;
+    mp->huge_pages = opt->huge_pages;
+    // 延迟提交模式下只有一个预留了全部地址空间的内存块, 不再扩展
+    mp->auto_extend = !mp->lazy_commit && opt->mempool_size < opt->max_mempool_size;
+    mp->max_mempool_size = opt->max_mempool_size;
+    mp->mempool_size = mp->lazy_commit ? opt->max_mempool_size
+                                       : memory_block_size(mp, opt->mempool_size, opt->max_mempool_size);
+    mp->alloc_mempool_size = 0; // 初始分配一个内存池
+    memset(&mp->stats, 0, sizeof(mp->stats));
+    mp->mlist = NULL;
+    mp->region = NULL;
+    mp->large_list = NULL;
+    // 阈值不超过内存块能容纳的最大申请, 放不进内存块的申请都按大对象分配
+    mp->large_threshold = opt->large_threshold ? opt->large_threshold : MP_LARGE_THRESHOLD;
+    mem_size_t fit = mp->policy == MP_POLICY_BUDDY ? buddy_floor_size(mp->mempool_size)
+                                                   : mp->mempool_size - MP_CHUNKHEADER;
+    fit = fit > 2 * MP_CHUNKHEADER ? fit - 2 * MP_CHUNKHEADER : 0;
+    if (mp->large_threshold > fit) mp->large_threshold = fit;
+    mp->cache_list = NULL;
+    mp->decay_ms = 0;
+    mp->last_decay = 0;
+    mp->defer_merge = opt->defer_merge && mp->policy != MP_POLICY_REGION;
+    memset(mp->fast_bins, 0, sizeof(mp->fast_bins));
+    mp->fast_mem = 0;
+    mp->file_size = 0;
+    mp->root = NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    mp->tcache_gen = 0;
+#endif
+}
+
+// 只在本进程内有效的部分: 地址索引, 锁与线程缓存. 持久化内存池重新打开时重建
+static int attach_pool(MemoryPool* mp, MemoryPool* parent) {
+    mp->pagemap = parent ? parent->pagemap : (_MP_Memory***) calloc(MP_PAGEMAP_SIZE, sizeof(_MP_Memory**));
+    if (!mp->pagemap) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    pthread_mutex_init(&mp->lock, NULL);
+    mp->tcache_list = NULL;
+    mp->remote_free = NULL;
+    mp->parent = parent;
+    mp->arenas = NULL;
+    mp->arena_count = 0;
+    if (slot_acquire(mp)) {
+        pthread_mutex_destroy(&mp->lock);
+        if (!parent) free(mp->pagemap);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+static void detach_pool(MemoryPool* mp) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    slot_release(mp);
+    pthread_mutex_destroy(&mp->lock);
+    if (mp->parent) return;
+#endif
+    destroy_pagemap(mp);
+}
+
+// 创建一个内存池; parent 非NULL时作为其分片, 共用地址索引, 内存块计入其总上限
+static MemoryPool* create_pool(const MemoryPoolOptions* opt, MemoryPool* parent) {
+    MemoryPool* mp = (MemoryPool*) malloc(sizeof(MemoryPool));
+    if (!mp) return NULL;
+
+    init_pool(mp, opt);
+    if (attach_pool(mp, parent)) {
+        free(mp);
+        return NULL;
+    }
+    // 延迟提交模式先提交 mempool_size, 否则整块提交(大页模式下已取整)
+    mem_size_t commit_sz = mp->lazy_commit ? opt->mempool_size : mp->mempool_size;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (parent && reserve_mempool_size(parent, commit_sz)) {
+        detach_pool(mp);
+        free(mp);
+        return NULL;
+    }
+#endif
+
+    if (!extend_memory_list(mp, mp->mempool_size, commit_sz)) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+        if (parent) MP_ATOMIC_SUB(&parent->alloc_mempool_size, commit_sz);
+#endif
+        detach_pool(mp);
+        free(mp);
+        return NULL;
+    }
+
+    return mp;
+}
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+/*
+ *  分片: 内存池由多个独立的分片(子内存池)组成, 各有自己的内存块, 锁, 线程缓存与统计
+ *  线程按 arena_mode 分配到分片, 释放时按块所在的内存块找到分片; 所有分片共用地址索引与总上限
+ */
+
+// 外层内存池只保存分片, 不持有内存块
+static MemoryPool* create_arenas(const MemoryPoolOptions* opt) {
+    if (opt->arenas > MP_ARENA_MAX || opt->policy == MP_POLICY_REGION || opt->lazy_commit ||
+        (opt->arena_mode != MP_ARENA_ROUND_ROBIN && opt->arena_mode != MP_ARENA_CPU) ||
+        (mem_size_t) opt->arenas * opt->mempool_size > opt->max_mempool_size)
+        return NULL;
+
+    MemoryPool* mp = (MemoryPool*) calloc(1, sizeof(MemoryPool));
+    if (!mp) return NULL;
+    mp->policy = opt->policy;
+    mp->huge_pages = opt->huge_pages;
+    mp->max_mempool_size = opt->max_mempool_size;
+    mp->mempool_size = opt->mempool_size;
+    mp->arena_mode = opt->arena_mode;
+    mp->pagemap = (_MP_Memory***) calloc(MP_PAGEMAP_SIZE, sizeof(_MP_Memory**));
+    mp->arenas = (MemoryPool**) calloc(opt->arenas, sizeof(MemoryPool*));
+    if (!mp->pagemap || !mp->arenas || slot_acquire(mp)) {
+        free(mp->pagemap);
+        free(mp->arenas);
+        free(mp);
+        return NULL;
+    }
+    pthread_mutex_init(&mp->lock, NULL);
+
+    for (; mp->arena_count < (unsigned int) opt->arenas; mp->arena_count++) {
+        if (!(mp->arenas[mp->arena_count] = create_pool(opt, mp))) {
+            MemoryPoolDestroy(mp);
+            return NULL;
+        }
+    }
+    return mp;
+}
+
+// 当前线程使用的分片. 轮流分配时首次使用记录在外层内存池的线程私有槽位中(下标+1)
+static MemoryPool* arena_of(MemoryPool* mp) {
+    if (mp->arena_mode == MP_ARENA_CPU) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0) return mp->arenas[cpu % mp->arena_count];
+    }
+    uintptr_t idx = (uintptr_t) thread_get(mp);
+    if (!idx) {
+        idx = __atomic_fetch_add(&mp->arena_next, 1, __ATOMIC_RELAXED) % mp->arena_count + 1;
+        thread_set(mp, (void*) idx);  // 失败时下次重新选择分片
+    }
+    return mp->arenas[idx - 1];
+}
+
+// 指针所属的分片, 不属于本内存池返回NULL
+static MemoryPool* arena_owner(MemoryPool* mp, void* p) {
+    _MP_Memory* mm = find_memory_list(mp, p);
+    return mm ? mm->pool : NULL;
+}
+#endif
+
+static int options_valid(const MemoryPoolOptions* opt) {
+    if (!opt || opt->mempool_size > opt->max_mempool_size) {
+        // printf("[MemoryPool_Init] MemPool Init ERROR! Mempoolsize is too big!
+        // \n");
+        return 0;
+    }
+    if (opt->policy != MP_POLICY_FIRST_FIT && opt->policy != MP_POLICY_BUDDY &&
+        opt->policy != MP_POLICY_REGION && opt->policy != MP_POLICY_BEST_FIT)
+        return 0;
+    if (opt->lazy_commit && opt->policy != MP_POLICY_FIRST_FIT && opt->policy != MP_POLICY_BEST_FIT)
+        return 0;
+    if (opt->min_align & (opt->min_align - 1) || opt->min_align > page_size()) return 0;
+    return opt->huge_pages >= MP_HUGE_NONE && opt->huge_pages <= MP_HUGE_TLB;
+}
+
+MemoryPool* MemoryPoolInitEx(const MemoryPoolOptions* opt) {
+    if (!options_valid(opt)) return NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (opt->arenas > 1) return create_arenas(opt);
+#endif
+    return create_pool(opt, NULL);
+}
+
+/*
+ *  持久化内存池: 唯一的内存块是文件的共享映射, 关闭后重新打开即可继续分配释放, 无需重建
+ *  文件总是映射到创建时的地址, 内存池内部的链接与应用数据中指向池内的指针都保持有效
+ *  布局: 文件头 + MemoryPool | 按 MP_SEGMENT_SIZE 对齐的内存块
+ */
+
+#define MP_FILE_MAGIC 0x4c4f4f504d454d5aULL  // "ZMEMPOOL"
+#define MP_FILE_VERSION 1
+
+typedef struct _mp_file_head {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pool_size;    // sizeof(MemoryPool), 线程安全模式不同的程序不能互相打开
+    mem_size_t file_size;
+    uintptr_t base;        // 映射地址
+    int dirty;             // 打开期间为1, 正常关闭时清零; 进程异常退出后只能以 MP_OPEN_RECOVER 打开
+} _MP_FileHead;
+
+#define MP_FILE_POOL(fh) ((MemoryPool*) ((char*) (fh) + MP_ALIGN_SIZE(sizeof(_MP_FileHead))))
+#define MP_FILE_HEAD(mp) ((_MP_FileHead*) ((char*) (mp) - MP_ALIGN_SIZE(sizeof(_MP_FileHead))))
+
+// 映射到 addr, 地址被占用时不能映射到别处(否则池内所有指针都会失效), 返回NULL
+static char* file_map(int fd, mem_size_t file_size, uintptr_t addr) {
+    int map_flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+    map_flags |= MAP_FIXED_NOREPLACE;
+#endif
+    char* base = (char*) mmap((void*) addr, file_size, PROT_READ | PROT_WRITE, map_flags, fd, 0);
+    if (base == (char*) MAP_FAILED) return NULL;
+    if ((uintptr_t) base != addr) {
+        os_free(base, file_size);
+        return NULL;
+    }
+    return base;
+}
+
+// 创建时的映射地址与系统的随机化布局无关, 在别的进程中重新打开时同一地址通常也是空闲的
+static MemoryPool* file_create(int fd, const MemoryPoolOptions* opt) {
+    MemoryPool tmp;
+    if (!options_valid(opt) || opt->lazy_commit || opt->huge_pages != MP_HUGE_NONE || opt->arenas > 1 ||
+        ((uintptr_t) opt->map_addr & (MP_SEGMENT_SIZE - 1)))
+        return NULL;
+
+    // 内存池结构先在栈上初始化, 以确定文件大小
+    init_pool(&tmp, opt);
+    tmp.auto_extend = 0;
+    tmp.max_mempool_size = tmp.mempool_size;
+    tmp.file_size = MP_SEGMENT_SIZE + memory_head_size(&tmp) + tmp.mempool_size;
+    // 新扩展的文件内容为0, 不占用磁盘空间
+    if (ftruncate(fd, tmp.file_size)) return NULL;
+    char* base = NULL;
+    uintptr_t addr = (uintptr_t) opt->map_addr;
+    int i;
+    if (addr) {
+        base = file_map(fd, tmp.file_size, addr);
+    } else {
+        for (addr = MP_FILE_BASE, i = 0; !base && i < MP_FILE_BASE_TRIES; i++) {
+            base = file_map(fd, tmp.file_size, addr);
+            addr += MP_ALIGN_UP(tmp.file_size, MP_SEGMENT_SIZE);
+        }
+    }
+    if (!base) return NULL;
+
+    _MP_FileHead* fh = (_MP_FileHead*) base;
+    MemoryPool* mp = MP_FILE_POOL(fh);
+    *mp = tmp;
+    if (attach_pool(mp, NULL)) {
+        os_free(base, tmp.file_size);
+        return NULL;
+    }
+    if (!add_memory(mp, base + MP_SEGMENT_SIZE, tmp.file_size - MP_SEGMENT_SIZE, MP_HUGE_NONE,
+                    mp->mempool_size, mp->mempool_size)) {
+        detach_pool(mp);
+        os_free(base, tmp.file_size);
+        return NULL;
+    }
+    fh->version = MP_FILE_VERSION;
+    fh->pool_size = sizeof(MemoryPool);
+    fh->file_size = tmp.file_size;
+    fh->base = (uintptr_t) base;
+    fh->dirty = 1;
+    // 最后写入, 创建中途失败的文件不会被当作有效文件打开
+    fh->magic = MP_FILE_MAGIC;
+    return mp;
+}
+
+// 按块头遍历内存块, 重建free桶并重新统计; 块大小不合法时返回1, 文件保持未关闭状态
+// 相邻的free块合并为一个, 块内容不再视为全0; 线程缓存, 延迟释放栈与快速复用桶中的块在块头上是已分配块, 只能保留
+static int recover_memory(MemoryPool* mp, _MP_Memory* mm) {
+    char* end = (char*) memory_fence(mm);
+    if (mp->policy == MP_POLICY_REGION) {
+        if (mm->alloc_mem > mm->mempool_size) return 1;
+        end = mm->start + mm->alloc_mem;
+    } else if (mp->policy == MP_POLICY_BUDDY) {
+        end = mm->start + (mm->mempool_size & ~(((mem_size_t) 1 << MP_BUDDY_MIN_ORDER) - 1));
+    }
+
+    mem_size_t sz = 0, alloc_mem = 0, prog_mem = 0, chunks = 0;
+    _MP_Chunk *ck = (_MP_Chunk*) mm->start, *run = NULL;
+    mm->bin_bitmap = 0;
+    memset(mm->free_bins, 0, sizeof(mm->free_bins));
+    memset(mm->free_trees, 0, sizeof(mm->free_trees));
+    for (; (char*) ck < end; ck = (_MP_Chunk*) ((char*) ck + sz)) {
+        sz = MP_CHUNK_SIZE(ck);
+        if (!sz || sz % sizeof(long) || sz > (mem_size_t) (end - (char*) ck)) return 1;
+        if (mp->policy == MP_POLICY_BUDDY &&
+            (sz & (sz - 1) || ((char*) ck - mm->start) & (sz - 1) || sz < ((mem_size_t) 1 << MP_BUDDY_MIN_ORDER)))
+            return 1;
+        if (!MP_CHUNK_IS_FREE(ck)) {
+            // free块放入桶时标记后一块, 其余已分配块清除前一块空闲的标志
+            if (run)
+                insert_free_chunk(mm, run);
+            else
+                ck->head &= ~(mem_size_t) MP_CHUNK_PREV_FREE;
+            run = NULL;
+            alloc_mem += sz;
+            prog_mem += sz - MP_CHUNKHEADER;
+            chunks++;
+        } else if (mp->policy == MP_POLICY_REGION) {
+            alloc_mem += sz;  // 对齐跳过的部分
+        } else {
+            init_free_chunk(ck, sz, 0);
+            if (mp->policy == MP_POLICY_BUDDY)
+                insert_free_chunk(mm, ck);
+            else if (run)
+                join_free_chunks(run, ck);
+            else
+                run = ck;
+        }
+    }
+    if (mp->policy != MP_POLICY_BUDDY && mp->policy != MP_POLICY_REGION) memory_fence(mm)->head = 0;
+    if (run) insert_free_chunk(mm, run);
+
+    mm->alloc_mem = alloc_mem;
+    mm->alloc_prog_mem = prog_mem;
+    mm->alloc_chunks = chunks;
+    MP_ATOMIC_ADD(&mp->stats.used_mem, alloc_mem);
+    MP_ATOMIC_ADD(&mp->stats.prog_mem, prog_mem);
+    MP_ATOMIC_ADD(&mp->stats.alloc_chunks, chunks);
+    return 0;
+}
+
+// 未正常关闭的文件: 丢弃快速复用桶, 由块头重建所有内存块
+static int file_recover(MemoryPool* mp) {
+    _MP_Memory* mm = NULL;
+    memset(mp->fast_bins, 0, sizeof(mp->fast_bins));
+    mp->fast_mem = 0;
+    mp->stats.used_mem = 0;
+    mp->stats.prog_mem = 0;
+    mp->stats.cache_mem = 0;
+    mp->stats.alloc_chunks = 0;
+    mp->stats.free_chunks = 0;
+    mp->stats.purged_mem = 0;
+    for (mm = mp->mlist; mm; mm = mm->next)
+        if (recover_memory(mp, mm)) return 1;
+    return 0;
+}
+
+static MemoryPool* file_open(int fd, mem_size_t file_size, int flags) {
+    _MP_FileHead head;
+    if (pread(fd, &head, sizeof(head), 0) != (ssize_t) sizeof(head) || head.magic != MP_FILE_MAGIC ||
+        head.version != MP_FILE_VERSION || head.pool_size != sizeof(MemoryPool) ||
+        head.file_size != file_size || (head.dirty && !(flags & MP_OPEN_RECOVER)))
+        return NULL;
+
+    char* base = file_map(fd, file_size, head.base);
+    if (!base) return NULL;
+
+    _MP_FileHead* fh = (_MP_FileHead*) base;
+    MemoryPool* mp = MP_FILE_POOL(fh);
+    _MP_Memory* mm = NULL;
+    if (attach_pool(mp, NULL)) {
+        os_free(base, file_size);
+        return NULL;
+    }
+    for (mm = mp->mlist; mm; mm = mm->next) {
+        if (pagemap_set(mp, mm, mm)) {
+            detach_pool(mp);
+            os_free(base, file_size);
+            return NULL;
+        }
+    }
+    if (head.dirty && file_recover(mp)) {
+        detach_pool(mp);
+        os_free(base, file_size);
+        return NULL;
+    }
+    mp->cache_list = NULL;
+    mp->last_decay = 0;
+    fh->dirty = 1;
+    return mp;
+}
+
+// 关闭持久化内存池, 文件保留
+static int file_close(MemoryPool* mp) {
+    _MP_FileHead* fh = MP_FILE_HEAD(mp);
+    mem_size_t file_size = mp->file_size;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    slot_release(mp);
+    MP_LOCK(mp);
+    // 线程缓存与延迟释放栈中的块在文件中仍是已分配块, 先还回free桶, 否则重新打开后再也无法释放
+    _MP_ThreadCache *tc = mp->tcache_list, *tc1 = NULL;
+    while (tc) {
+        tc1 = tc;
+        tc = tc->next;
+        tcache_flush_locked(tc1);
+        free(tc1);
+    }
+    mp->tcache_list = NULL;
+    remote_drain_locked(mp);
+    MP_UNLOCK(mp);
+    pthread_mutex_destroy(&mp->lock);
+#endif
+    destroy_pagemap(mp);
+    // 内容落盘后才清除 dirty
+    msync(fh, file_size, MS_SYNC);
+    fh->dirty = 0;
+    msync(fh, page_size(), MS_SYNC);
+    os_free(fh, file_size);
+    return 0;
+}
+
+MemoryPool* MemoryPoolOpen(const char* path, const MemoryPoolOptions* opt) {
+    struct stat st;
+    MemoryPool* mp = NULL;
+    if (!path) return NULL;
+    int fd = open(path, opt ? O_RDWR | O_CREAT : O_RDWR, 0644);
+    if (fd < 0) return NULL;
+    // 映射持有打开的文件, 文件锁一直保持到关闭, 同一文件同时只能被打开一次
+    if (!flock(fd, LOCK_EX | LOCK_NB) && !fstat(fd, &st)) {
+        if (st.st_size) {
+            mp = file_open(fd, (mem_size_t) st.st_size, opt ? opt->open_flags : 0);
+        } else if (opt) {
+            mp = file_create(fd, opt);
+            // 创建失败时恢复为空文件, 之后仍可重新创建(截断失败同样只能返回NULL)
+            if (!mp && ftruncate(fd, 0)) mp = NULL;
+        }
+    }
+    close(fd);
+    return mp;
+}
+
+void* MemoryPoolGetRoot(MemoryPool* mp) {
+    return mp ? MP_ACQUIRE_LOAD(&mp->root) : NULL;
+}
+
+int MemoryPoolSetRoot(MemoryPool* mp, void* root) {
+    if (!mp) return 1;
+    MP_RELEASE_STORE(&mp->root, root);
+    return 0;
+}
+
+// 申请 wantsize 字节需要的块大小(含管理信息), 超出单个内存块能提供的大小则返回0
+static mem_size_t chunk_size_of(MemoryPool* mp, mem_size_t wantsize) {
+    if (wantsize <= 0) return 0;
+    mem_size_t total_needed_size = MP_ALIGN_UP(wantsize + MP_CHUNKHEADER, mp->min_align);
+    if (total_needed_size < wantsize) return 0;
+    // 区域模式的块不会变成free块
+    if (total_needed_size < MP_CHUNK_MIN(mp) && mp->policy != MP_POLICY_REGION)
+        total_needed_size = MP_ALIGN_UP(MP_CHUNK_MIN(mp), mp->min_align);
+    if (mp->policy == MP_POLICY_BUDDY) {
+        total_needed_size = buddy_size(total_needed_size);
+        if (total_needed_size > buddy_floor_size(mp->mempool_size)) return 0;
+    }
+    // 非伙伴模式内存块末尾有哨兵块头
+    else if (total_needed_size > mp->mempool_size - MP_CHUNKHEADER) return 0;
+    return total_needed_size;
+}
+
+// 区域分配的块不单独释放; 持久化内存池的块都在文件中, 大对象的匿名映射关闭后无法保留
+static inline int large_enabled(MemoryPool* mp) {
+    return mp->policy != MP_POLICY_REGION && !mp->file_size;
+}
+
+static inline int is_large(MemoryPool* mp, mem_size_t wantsize) {
+    return wantsize >= mp->large_threshold && large_enabled(mp);
+}
+
+static void* large_alloc(MemoryPool* mp, mem_size_t wantsize) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+#endif
+    _MP_Chunk* ck = large_alloc_locked(mp, wantsize);
+    if (!ck) MP_STAT_ADD(&mp->stats.alloc_fails, 1);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return ck ? (void*) ((char*) ck + MP_CHUNKHEADER) : NULL;
+}
+
+static void large_free(MemoryPool* mp, _MP_Memory* mm) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+#endif
+    mem_size_t map_sz = large_unlink_locked(mp, mm);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    os_free(mm, map_sz);
+}
+
+// p 是大对象或新大小按大对象分配: 大对象之间优先原地调整映射, 否则重新分配并拷贝
+static void* large_realloc(MemoryPool* mp, _MP_Memory* mm, void* p, mem_size_t wantsize) {
+    _MP_Chunk* ck = (_MP_Chunk*) ((char*) p - MP_CHUNKHEADER);
+    mem_size_t old = MP_CHUNK_PROG_SIZE(ck), sz = 0;
+    int resized = 1;
+    if (mm->large && is_large(mp, wantsize) && (sz = large_chunk_size(wantsize))) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+        MP_LOCK(mp);
+#endif
+        resized = large_resize_locked(mp, mm, sz);
+#ifdef _Z_MEMORYPOOL_THREAD_
+        MP_UNLOCK(mp);
+#endif
+        if (!resized) return p;
+    }
+
+    void* np = MemoryPoolAlloc(mp, wantsize);
+    if (!np) return NULL;
+    memcpy(np, p, old < wantsize ? old : wantsize);
+    MemoryPoolFree(mp, p);
+    return np;
+}
+
+void* MemoryPoolAlloc(MemoryPool* mp, mem_size_t wantsize) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) return MemoryPoolAlloc(arena_of(mp), wantsize);
+#endif
+    if (is_large(mp, wantsize)) return large_alloc(mp, wantsize);
+    mem_size_t total_needed_size = chunk_size_of(mp, wantsize);
+    if (!total_needed_size) return NULL;
+
+    _MP_Chunk* ck = NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (total_needed_size <= MP_TCACHE_MAX_SIZE &&
+        (ck = tcache_get(mp, total_needed_size)))
+        return (void*) ((char*) ck + MP_CHUNKHEADER);
+
+    MP_LOCK(mp);
+#endif
+    if (!(ck = alloc_chunk_locked(mp, total_needed_size))) MP_STAT_ADD(&mp->stats.alloc_fails, 1);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return ck ? (void*) ((char*) ck + MP_CHUNKHEADER) : NULL;
+}
+
+void* MemoryPoolCalloc(MemoryPool* mp, mem_size_t n, mem_size_t size) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) return MemoryPoolCalloc(arena_of(mp), n, size);
+#endif
+    if (size && n > (mem_size_t) -1 / size) return NULL;
+    mem_size_t wantsize = n * size;
+    // 大对象是新映射的内存, 内容全为0
+    if (is_large(mp, wantsize)) return large_alloc(mp, wantsize);
+    mem_size_t total_needed_size = chunk_size_of(mp, wantsize);
+    if (!total_needed_size) return NULL;
+
+    _MP_Chunk* ck = NULL;
+    mem_size_t head = 0;  // 刚从内存池分配时的块头, 线程缓存中的块总是清零
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (total_needed_size <= MP_TCACHE_MAX_SIZE)
+        ck = tcache_get(mp, total_needed_size);
+    if (!ck) {
+        MP_LOCK(mp);
+        if ((ck = alloc_chunk_locked(mp, total_needed_size)))
+            head = ck->head;
+        else
+            MP_STAT_ADD(&mp->stats.alloc_fails, 1);
+        MP_UNLOCK(mp);
+    }
+#else
+    if ((ck = alloc_chunk_locked(mp, total_needed_size)))
+        head = ck->head;
+    else
+        MP_STAT_ADD(&mp->stats.alloc_fails, 1);
+#endif
+    if (!ck) return NULL;
+
+    // 自从系统获得后从未分配出去过的内存无需再清零, 只需清掉free块留下的链表/树指针与块尾
+    char* p = (char*) ck + MP_CHUNKHEADER;
+    if (!(head & MP_CHUNK_ZERO)) {
+        memset(p, 0, wantsize);
+    } else {
+        char* links = (char*) ck + MP_FREE_META;
+        char* foot = (char*) ck + (head & ~(mem_size_t) MP_CHUNK_FLAGS) - MP_CHUNKEND;
+        memset(p, 0, (mem_size_t) (links - p) < wantsize ? (mem_size_t) (links - p) : wantsize);
+        if (p + wantsize > foot) memset(foot, 0, p + wantsize - foot);
+    }
+    return (void*) p;
+}
+
+void* MemoryPoolAllocAligned(MemoryPool* mp, mem_size_t wantsize, mem_size_t alignment) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) return MemoryPoolAllocAligned(arena_of(mp), wantsize, alignment);
+#endif
+    if (alignment & (alignment - 1)) return NULL;
+    if (alignment <= mp->min_align) return MemoryPoolAlloc(mp, wantsize);
+    // 大对象的数据区按页对齐
+    int large_ok = alignment <= page_size() && large_enabled(mp);
+    if (large_ok && is_large(mp, wantsize)) return large_alloc(mp, wantsize);
+
+    mem_size_t total_needed_size = chunk_size_of(mp, wantsize);
+    if (!total_needed_size) return NULL;
+    // 非伙伴模式需要额外的对齐空间
+    if (mp->policy != MP_POLICY_BUDDY &&
+        total_needed_size + alignment + MP_CHUNK_MIN(mp) > mp->mempool_size - MP_CHUNKHEADER)
+        return large_ok ? large_alloc(mp, wantsize) : NULL;
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+#endif
+    _MP_Chunk* ck = alloc_aligned_chunk_locked(mp, total_needed_size, alignment);
+    if (!ck) MP_STAT_ADD(&mp->stats.alloc_fails, 1);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return ck ? (void*) ((char*) ck + MP_CHUNKHEADER) : NULL;
+}
+
+void* MemoryPoolRealloc(MemoryPool* mp, void* p, mem_size_t wantsize) {
+    if (p == NULL) return MemoryPoolAlloc(mp, wantsize);
+    if (wantsize == 0) {
+        MemoryPoolFree(mp, p);
+        return NULL;
+    }
+#ifdef _Z_MEMORYPOOL_THREAD_
+    // 在块所属的分片中原地调整或重新分配
+    if (mp->arenas) {
+        MemoryPool* owner = arena_owner(mp, p);
+        return owner ? MemoryPoolRealloc(owner, p, wantsize) : NULL;
+    }
+#endif
+
+    _MP_Chunk* ck = (_MP_Chunk*) ((char*) p - MP_CHUNKHEADER);
+    _MP_Memory* mm = find_memory_list(mp, p);
+    if (!mm || (char*) ck < mm->start || (MP_ATOMIC_LOAD(&ck->head) & MP_CHUNK_FREE)) return NULL;
+    if (mm->large || is_large(mp, wantsize)) return large_realloc(mp, mm, p, wantsize);
+    mem_size_t total_needed_size = chunk_size_of(mp, wantsize);
+    if (!total_needed_size) return NULL;
+
+    void* np = NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+#endif
+    // 优先原地缩小/扩大
+    if (mp->policy == MP_POLICY_BUDDY) {
+        if (!buddy_resize_chunk_locked(mp, mm, ck, total_needed_size)) np = p;
+    } else if (mp->policy == MP_POLICY_REGION) {
+        if (!region_resize_locked(mp, mm, ck, total_needed_size)) np = p;
+    } else if (total_needed_size <= MP_CHUNK_SIZE(ck)) {
+        shrink_chunk_locked(mp, mm, ck, total_needed_size);
+        np = p;
+    } else if (!grow_chunk_locked(mp, mm, ck, total_needed_size)) {
+        np = p;
+    }
+
+    // 否则重新分配并拷贝
+    if (!np) {
+        _MP_Chunk* nck = alloc_chunk_locked(mp, total_needed_size);
+        if (nck) {
+            np = (char*) nck + MP_CHUNKHEADER;
+            memcpy(np, p, MP_CHUNK_PROG_SIZE(ck) < wantsize ? MP_CHUNK_PROG_SIZE(ck) : wantsize);
+            free_chunk_locked(mp, mm, ck);
+        } else {
+            MP_STAT_ADD(&mp->stats.alloc_fails, 1);
+        }
+    }
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return np;
+}
+
+int MemoryPoolFree(MemoryPool* mp, void* p) {
+    if (p == NULL || mp == NULL) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) {
+        MemoryPool* owner = arena_owner(mp, p);
+        return owner ? MemoryPoolFree(owner, p) : 1;
+    }
+#endif
+
+    // 拒绝不属于本内存池的指针以及重复释放
+    // 不加锁时其他线程可能正在修改块头的 MP_CHUNK_PREV_FREE, 原子读取
+    _MP_Chunk* ck = (_MP_Chunk*) ((char*) p - MP_CHUNKHEADER);
+    _MP_Memory* mm = find_memory_list(mp, p);
+    if (!mm || (char*) ck < mm->start) return 1;
+    mem_size_t head = MP_ATOMIC_LOAD(&ck->head);
+    if (head & MP_CHUNK_FREE) return 1;
+    if (mp->policy == MP_POLICY_REGION) return 0;
+    if (mm->large) {
+        large_free(mp, mm);
+        return 0;
+    }
+#ifdef _Z_MEMORYPOOL_THREAD_
+    mem_size_t sz = head & ~(mem_size_t) MP_CHUNK_FLAGS;
+    if (sz <= MP_TCACHE_MAX_SIZE && tcache_put(mp, ck, sz)) return 0;
+
+    if (!MP_TRYLOCK(mp)) {
+        remote_push(mp, ck, ck);
+        return 0;
+    }
+    remote_drain_locked(mp);
+#endif
+    free_chunk_locked(mp, mm, ck);
+    decay_locked(mp);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return 0;
+}
+
+mem_size_t MemoryPoolUsableSize(MemoryPool* mp, void* p) {
+    if (p == NULL || mp == NULL) return 0;
+    // 与 MemoryPoolFree 相同的检查, 不加锁; 分片共用地址索引, 外层内存池也能直接找到
+    _MP_Chunk* ck = (_MP_Chunk*) ((char*) p - MP_CHUNKHEADER);
+    _MP_Memory* mm = find_memory_list(mp, p);
+    if (!mm || (char*) ck < mm->start) return 0;
+    mem_size_t head = MP_ATOMIC_LOAD(&ck->head);
+    if (head & MP_CHUNK_FREE) return 0;
+    return (head & ~(mem_size_t) MP_CHUNK_FLAGS) - MP_CHUNKHEADER;
+}
+
+int MemoryPoolFlushThreadCache(MemoryPool* mp) {
+    if (mp == NULL) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    unsigned int i;
+    for (i = 0; i < mp->arena_count; i++) MemoryPoolFlushThreadCache(mp->arenas[i]);
+    if (mp->arenas) return 0;
+    _MP_ThreadCache* tc = (_MP_ThreadCache*) thread_get(mp);
+    if (!tc) return 0;
+    MP_LOCK(mp);
+    tcache_flush_locked(tc);
+    MP_UNLOCK(mp);
+#endif
+    return 0;
+}
+
+mem_size_t MemoryPoolTrim(MemoryPool* mp) {
+    if (mp == NULL) return 0;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) {
+        mem_size_t sum = 0;
+        unsigned int i;
+        for (i = 0; i < mp->arena_count; i++) sum += MemoryPoolTrim(mp->arenas[i]);
+        return sum;
+    }
+#endif
+    MemoryPoolFlushThreadCache(mp);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+    remote_drain_locked(mp);
+#endif
+    mem_size_t released = trim_locked(mp, 0);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return released;
+}
+
+mem_size_t MemoryPoolCompact(MemoryPool* mp) {
+    if (mp == NULL) return 0;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) {
+        mem_size_t sum = 0;
+        unsigned int i;
+        for (i = 0; i < mp->arena_count; i++) sum += MemoryPoolCompact(mp->arenas[i]);
+        return sum;
+    }
+#endif
+    MemoryPoolFlushThreadCache(mp);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+    remote_drain_locked(mp);
+#endif
+    mem_size_t merged = fast_merge_locked(mp);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return merged;
+}
+
+int MemoryPoolSetDecay(MemoryPool* mp, unsigned int decay_ms) {
+    if (mp == NULL) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    unsigned int i;
+    for (i = 0; i < mp->arena_count; i++) MemoryPoolSetDecay(mp->arenas[i], decay_ms);
+    MP_LOCK(mp);
+#endif
+    mp->decay_ms = decay_ms;
+    mp->last_decay = now_ms();
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return 0;
+}
+
+int MemoryPoolMark(MemoryPool* mp, MemoryPoolMarker* mark) {
+    if (mp == NULL || mark == NULL || mp->policy != MP_POLICY_REGION) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+#endif
+    _MP_Memory* mm = mp->region;
+    mark->mm = mm;
+    mark->id = mm ? mm->id : 0;
+    mark->alloc_mem = mm ? mm->alloc_mem : 0;
+    mark->alloc_prog_mem = mm ? mm->alloc_prog_mem : 0;
+    mark->alloc_chunks = mm ? mm->alloc_chunks : 0;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return 0;
+}
+
+int MemoryPoolRewind(MemoryPool* mp, const MemoryPoolMarker* mark) {
+    if (mp == NULL || mark == NULL || mp->policy != MP_POLICY_REGION) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+#endif
+    // 保存点所在的内存块必须仍然存在, 且保存点之后没有回退到更早的位置
+    _MP_Memory* mm = mp->mlist;
+    while (mm && mm != mark->mm) mm = mm->next;
+    if (mark->mm && (!mm || mm->id != mark->id || !mp->region || mm->id > mp->region->id ||
+                     mm->alloc_mem < mark->alloc_mem)) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+        MP_UNLOCK(mp);
+#endif
+        return 1;
+    }
+
+    for (mm = mp->mlist; mm; mm = mm->next) {
+        if (mm == mark->mm)
+            region_reset(mp, mm, mark->alloc_mem, mark->alloc_prog_mem, mark->alloc_chunks);
+        else if (!mark->mm || mm->id > mark->id)
+            region_reset(mp, mm, 0, 0, 0);
+    }
+    mp->region = mark->mm;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return 0;
+}
+
+/*
+ *  对象缓存: 从内存池中按 slab_size 对齐分配slab, 对象不带管理信息
+ *  对象地址按 slab_size 向下取整即得到所属slab
+ */
+
+#define MP_SLAB_SIZE (64 * KB)  // 默认slab大小
+#define MP_SLAB_MIN_OBJS 8      // 每个slab至少容纳的对象数
+#define MP_SLAB_OF(cache, p) \
+    ((_MP_Slab*) ((uintptr_t) (p) & ~(uintptr_t) ((cache)->slab_size - 1)))
+
+// 需持有对象缓存锁
+static void cache_move_slab(_MP_Slab** from, _MP_Slab** to, _MP_Slab* slab) {
+    MP_DLINKLIST_DEL((*from), slab);
+    MP_DLINKLIST_INS_FRT((*to), slab);
+}
+
+static void cache_release_slabs(MemoryPoolCache* cache, _MP_Slab* slab) {
+    _MP_Slab* next = NULL;
+    while (slab) {
+        next = slab->next;
+        MemoryPoolFree(cache->mp, slab);
+        slab = next;
+    }
+}
+
+// 内存池被清空后slab全部失效
+static void cache_reset(MemoryPoolCache* cache) {
+    cache->partial = cache->full = cache->empty = NULL;
+    cache->empty_count = 0;
+}
+
+// slab 能否按自身大小对齐从一个空的内存块中切出, 与 alloc_aligned_chunk_locked 的要求一致
+static int slab_fits(MemoryPool* mp, mem_size_t sz) {
+    if (mp->policy == MP_POLICY_BUDDY) return sz <= MP_SEGMENT_SIZE && sz <= buddy_floor_size(mp->mempool_size);
+    return MP_ALIGN_UP(sz + sz + MP_CHUNK_MIN(mp), mp->min_align) + MP_CHUNKHEADER <= mp->mempool_size;
+}
+
+MemoryPoolCache* MemoryPoolCacheCreate(MemoryPool* mp, mem_size_t obj_size, mem_size_t align) {
+    // 区域模式下slab无法单独归还; 持久化内存池中的slab在对象缓存(进程内)消失后无法再使用
+    if (!mp || obj_size == 0 || mp->policy == MP_POLICY_REGION || mp->file_size) return NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    // slab 都从创建线程所在的分片取得
+    if (mp->arenas) return MemoryPoolCacheCreate(arena_of(mp), obj_size, align);
+#endif
+    if (align < mp->min_align) align = mp->min_align;
+    if (align & (align - 1) || obj_size > mp->mempool_size) return NULL;
+
+    if (obj_size < sizeof(void*)) obj_size = sizeof(void*);
+    obj_size = (obj_size + align - 1) & ~(align - 1);
+    mem_size_t first_offset = (sizeof(_MP_Slab) + align - 1) & ~(align - 1);
+    // 每个slab恰好占用内存池中一个 slab_size 大小的块, 可用部分需扣除块的管理信息
+    // 尽量容纳 MP_SLAB_MIN_OBJS 个对象, 内存块放不下时减少, 一个也放不下则创建失败
+    mem_size_t slab_size = MP_SLAB_SIZE;
+    while (slab_size - MP_CHUNKHEADER < first_offset + obj_size * MP_SLAB_MIN_OBJS &&
+           slab_fits(mp, slab_size << 1))
+        slab_size <<= 1;
+    if (!slab_fits(mp, slab_size) || slab_size - MP_CHUNKHEADER < first_offset + obj_size) return NULL;
+
+    MemoryPoolCache* cache = (MemoryPoolCache*) malloc(sizeof(MemoryPoolCache));
+    if (!cache) return NULL;
+    cache->mp = mp;
+    cache->obj_size = obj_size;
+    cache->first_offset = first_offset;
+    cache->slab_size = slab_size;
+    cache->slab_objs = (unsigned int) ((slab_size - MP_CHUNKHEADER - first_offset) / obj_size);
+    cache_reset(cache);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    pthread_mutex_init(&cache->lock, NULL);
+    MP_LOCK(mp);
+#endif
+    MP_DLINKLIST_INS_FRT(mp->cache_list, cache);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return cache;
+}
+
+void* MemoryPoolCacheAlloc(MemoryPoolCache* cache) {
+    if (!cache) return NULL;
+    void* obj = NULL;
+    _MP_Slab* slab = NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(cache);
+#endif
+    if (!(slab = cache->partial)) {
+        if ((slab = cache->empty)) {
+            cache_move_slab(&cache->empty, &cache->partial, slab);
+            cache->empty_count--;
+        } else {
+            MemoryPool* mp = cache->mp;
+            _MP_Chunk* ck = NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+            MP_LOCK(mp);
+#endif
+            ck = alloc_aligned_chunk_locked(mp, cache->slab_size, cache->slab_size);
+#ifdef _Z_MEMORYPOOL_THREAD_
+            MP_UNLOCK(mp);
+#endif
+            if (!ck) goto out;
+
+            slab = (_MP_Slab*) ((char*) ck + MP_CHUNKHEADER);
+            slab->cache = cache;
+            slab->free_list = NULL;
+            slab->inuse = slab->carved = 0;
+            MP_DLINKLIST_INS_FRT(cache->partial, slab);
+        }
+    }
+
+    // 优先复用释放的对象, 否则从未使用过的部分切出
+    if (slab->free_list) {
+        obj = slab->free_list;
+        slab->free_list = *(void**) obj;
+    } else {
+        obj = (char*) slab + cache->first_offset +
+              (mem_size_t) slab->carved++ * cache->obj_size;
+    }
+    if (++slab->inuse == cache->slab_objs)
+        cache_move_slab(&cache->partial, &cache->full, slab);
+out:
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(cache);
+#endif
+    return obj;
+}
+
+int MemoryPoolCacheFree(MemoryPoolCache* cache, void* p) {
+    if (!cache || !p) return 1;
+    _MP_Slab* slab = MP_SLAB_OF(cache, p);
+    _MP_Slab* release = NULL;
+    // 先确认slab头落在内存池已提交的范围内, 再读取其所属缓存
+    if (!find_memory_list(cache->mp, p) || !find_memory_list(cache->mp, slab) || slab->cache != cache)
+        return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(cache);
+#endif
+    *(void**) p = slab->free_list;
+    slab->free_list = p;
+    if (slab->inuse-- == cache->slab_objs)
+        cache_move_slab(&cache->full, &cache->partial, slab);
+    if (slab->inuse == 0) {
+        // 保留一个空slab, 避免在边界上反复申请释放
+        if (cache->empty_count) {
+            MP_DLINKLIST_DEL(cache->partial, slab);
+            release = slab;
+            release->next = NULL;
+        } else {
+            cache_move_slab(&cache->partial, &cache->empty, slab);
+            cache->empty_count++;
+        }
+    }
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(cache);
+#endif
+    if (release) cache_release_slabs(cache, release);
+    return 0;
+}
+
+int MemoryPoolCacheDestroy(MemoryPoolCache* cache) {
+    if (!cache) return 1;
+    MemoryPool* mp = cache->mp;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+#endif
+    MP_DLINKLIST_DEL(mp->cache_list, cache);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    cache_release_slabs(cache, cache->partial);
+    cache_release_slabs(cache, cache->full);
+    cache_release_slabs(cache, cache->empty);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    free(cache);
+    return 0;
+}
+
+/*
+ *  批量分配释放: 只加一次锁
+ */
+
+int MemoryPoolAllocBatch(MemoryPool* mp, const mem_size_t sizes[], int n, void* out[]) {
+    if (!mp || n <= 0) return 0;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) return MemoryPoolAllocBatch(arena_of(mp), sizes, n, out);
+#endif
+    int i, cnt = 0, contig = mp->policy != MP_POLICY_BUDDY;
+    mem_size_t total = 0, need = 0;
+    for (i = 0; i < n; i++) out[i] = NULL;
+    // 有大对象或非法尺寸时不能整段切分, 逐个分配
+    for (i = 0; i < n && contig; i++) {
+        if (is_large(mp, sizes[i]) || !(need = chunk_size_of(mp, sizes[i])) || total + need < total)
+            contig = 0;
+        else
+            total += need;
+    }
+
+    _MP_Chunk* ck = NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+#endif
+    // 非伙伴模式下尽量从同一个free块中连续切分出所有块
+    if (contig && total <= mp->mempool_size - MP_CHUNKHEADER && (ck = alloc_chunk_locked(mp, total))) {
+        _MP_Memory* mm = find_memory_list(mp, ck);
+        mem_size_t rest = MP_CHUNK_SIZE(ck);
+        mem_size_t flags = ck->head & (MP_CHUNK_PREV_FREE | MP_CHUNK_ZERO);
+        // alloc_chunk_locked 按整段记录了一次尺寸分布, 改为每块各记一次
+        MP_STAT_ADD(&mp->stats.alloc_hist[bin_index(total)], -1);
+        for (i = 0; i < n; i++) {
+            // 最后一块包含切分剩下的部分
+            need = i == n - 1 ? rest : chunk_size_of(mp, sizes[i]);
+            rest -= need;
+            ck->head = need | flags;
+            flags &= ~(mem_size_t) MP_CHUNK_PREV_FREE;
+            out[i] = (char*) ck + MP_CHUNKHEADER;
+            MP_STAT_ADD(&mp->stats.alloc_hist[bin_index(need)], 1);
+            ck = (_MP_Chunk*) ((char*) ck + need);
+        }
+        mm->alloc_chunks += n - 1;
+        mm->alloc_prog_mem -= (n - 1) * MP_CHUNKHEADER;
+        MP_ATOMIC_SUB(&mp->stats.prog_mem, (n - 1) * MP_CHUNKHEADER);
+        MP_ATOMIC_ADD(&mp->stats.alloc_chunks, n - 1);
+        MP_STAT_ADD(&mp->stats.split_count, n - 1);
+        cnt = n;
+    } else {
+        for (cnt = 0; cnt < n; cnt++) {
+            if (is_large(mp, sizes[cnt]))
+                ck = large_alloc_locked(mp, sizes[cnt]);
+            else if ((need = chunk_size_of(mp, sizes[cnt])))
+                ck = alloc_chunk_locked(mp, need);
+            else
+                break;
+            if (!ck) {
+                MP_STAT_ADD(&mp->stats.alloc_fails, 1);
+                break;
+            }
+            out[cnt] = (char*) ck + MP_CHUNKHEADER;
+        }
+    }
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return cnt;
+}
+
+static int ptr_cmp(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t) * (void* const*) a, y = (uintptr_t) * (void* const*) b;
+    return x < y ? -1 : x > y;
+}
+
+int MemoryPoolFreeBatch(MemoryPool* mp, void* ptrs[], int n) {
+    if (!mp || n <= 0) return 0;
+    int i, bad = 0;
+    // 按地址排序, 物理相邻的块先连成一段, 每段只合并一次
+    qsort(ptrs, n, sizeof(void*), ptr_cmp);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    // 排序后同一分片的块大多连续, 按所属分片分段释放
+    if (mp->arenas) {
+        MemoryPool *owner = NULL, *next = NULL;
+        int start = 0;
+        for (i = 0; i <= n; i++) {
+            next = NULL;
+            if (i < n && ptrs[i] && !(next = arena_owner(mp, ptrs[i]))) bad++;
+            if (i < n && next == owner) continue;
+            if (owner) bad += MemoryPoolFreeBatch(owner, ptrs + start, i - start);
+            owner = next;
+            start = i;
+        }
+        return bad;
+    }
+#endif
+
+    _MP_Memory *mm = NULL, *run_mm = NULL;
+    _MP_Chunk *ck = NULL, *run = NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_LOCK(mp);
+#endif
+    for (i = 0; i < n; i++) {
+        if (!ptrs[i]) continue;
+        ck = (_MP_Chunk*) ((char*) ptrs[i] - MP_CHUNKHEADER);
+        mm = find_memory_list(mp, ptrs[i]);
+        if (!mm || (char*) ck < mm->start || MP_CHUNK_IS_FREE(ck)) {
+            bad++;
+            continue;
+        }
+        if (mp->policy == MP_POLICY_REGION) continue;
+        if (mm->large) {
+            os_free(mm, large_unlink_locked(mp, mm));
+            continue;
+        }
+
+        mm->alloc_chunks--;
+        mm->alloc_mem -= MP_CHUNK_SIZE(ck);
+        mm->alloc_prog_mem -= MP_CHUNK_PROG_SIZE(ck);
+        MP_ATOMIC_SUB(&mp->stats.used_mem, MP_CHUNK_SIZE(ck));
+        MP_ATOMIC_SUB(&mp->stats.prog_mem, MP_CHUNK_PROG_SIZE(ck));
+        MP_ATOMIC_SUB(&mp->stats.alloc_chunks, 1);
+        ck->head &= ~(mem_size_t) MP_CHUNK_ZERO;
+
+        if (mp->policy == MP_POLICY_BUDDY) {
+            free_chunk(mp, mm, ck);
+            continue;
+        }
+        if (run && run_mm == mm && MP_CHUNK_NEXT(run) == ck) {
+            run->head += MP_CHUNK_SIZE(ck);
+            MP_STAT_ADD(&mp->stats.merge_count, 1);
+        } else {
+            // 上一段先合并再标记本块, 以免上一段向后合并时遇到尚未入桶的本块
+            if (run) free_chunk(mp, run_mm, run);
+            run = ck;
+            run_mm = mm;
+        }
+        ck->head |= MP_CHUNK_FREE;
+    }
+    if (run) free_chunk(mp, run_mm, run);
+    decay_locked(mp);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return bad;
+}
+
+MemoryPool* MemoryPoolClear(MemoryPool* mp) {
+    if (!mp) return NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    unsigned int i;
+    for (i = 0; i < mp->arena_count; i++) MemoryPoolClear(mp->arenas[i]);
+    if (mp->arenas) return mp;
+    MP_LOCK(mp);
+    // 所有块都会被重置, 线程缓存与延迟释放栈中的块直接作废
+    mp->tcache_gen++;
+    __atomic_store_n(&mp->remote_free, NULL, __ATOMIC_RELAXED);
+#endif
+    // 大对象直接归还系统, 其统计值随之扣除
+    large_free_all_locked(mp);
+    MP_ATOMIC_STORE(&mp->stats.used_mem, 0);
+    MP_ATOMIC_STORE(&mp->stats.prog_mem, 0);
+    MP_ATOMIC_STORE(&mp->stats.cache_mem, 0);
+    MP_ATOMIC_STORE(&mp->stats.alloc_chunks, 0);
+    MP_ATOMIC_STORE(&mp->stats.free_chunks, 0);
+    MP_ATOMIC_STORE(&mp->stats.purged_mem, 0);
+    memset(mp->fast_bins, 0, sizeof(mp->fast_bins));
+    mp->fast_mem = 0;
+    MemoryPoolCache* cache = mp->cache_list;
+    while (cache) {
+        cache_reset(cache);
+        cache = cache->next;
+    }
+    _MP_Memory* mm = mp->mlist;
+    while (mm) {
+        MP_INIT_MEMORY_STRUCT(mp, mm, mm->mempool_size, 0);
+        mm = mm->next;
+    }
+    mp->region = NULL;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return mp;
+}
+
+int MemoryPoolDestroy(MemoryPool* mp) {
+    if (mp == NULL) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    // 分片共用的地址索引由外层内存池释放
+    if (mp->arenas) {
+        unsigned int i;
+        for (i = 0; i < mp->arena_count; i++) MemoryPoolDestroy(mp->arenas[i]);
+        slot_release(mp);
+        destroy_pagemap(mp);
+        free(mp->arenas);
+        pthread_mutex_destroy(&mp->lock);
+        free(mp);
+        return 0;
+    }
+#endif
+    if (mp->file_size) return file_close(mp);
+    // 对象缓存的slab随内存块一起释放
+    MemoryPoolCache *cache = mp->cache_list, *cache1 = NULL;
+    while (cache) {
+        cache1 = cache;
+        cache = cache->next;
+#ifdef _Z_MEMORYPOOL_THREAD_
+        pthread_mutex_destroy(&cache1->lock);
+#endif
+        free(cache1);
+    }
+#ifdef _Z_MEMORYPOOL_THREAD_
+    slot_release(mp);
+    MP_LOCK(mp);
+    _MP_ThreadCache *tc = mp->tcache_list, *tc1 = NULL;
+    while (tc) {
+        tc1 = tc;
+        tc = tc->next;
+        free(tc1);
+    }
+#endif
+    large_free_all_locked(mp);
+    _MP_Memory *mm = mp->mlist, *mm1 = NULL;
+    while (mm) {
+        mm1 = mm;
+        mm = mm->next;
+        os_free(mm1, memory_map_size(mp, mm1));
+    }
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (!mp->parent)
+#endif
+        destroy_pagemap(mp);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+    pthread_mutex_destroy(&mp->lock);
+#endif
+    free(mp);
+    return 0;
+}
+
+mem_size_t GetTotalMemory(MemoryPool* mp) {
+    return MP_ATOMIC_LOAD(&mp->alloc_mempool_size);
+}
+
+mem_size_t GetUsedMemory(MemoryPool* mp) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) {
+        mem_size_t sum = 0;
+        unsigned int i;
+        for (i = 0; i < mp->arena_count; i++) sum += GetUsedMemory(mp->arenas[i]);
+        return sum;
+    }
+#endif
+    return MP_ATOMIC_LOAD(&mp->stats.used_mem);
+}
+
+mem_size_t GetProgMemory(MemoryPool* mp) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) {
+        mem_size_t sum = 0;
+        unsigned int i;
+        for (i = 0; i < mp->arena_count; i++) sum += GetProgMemory(mp->arenas[i]);
+        return sum;
+    }
+#endif
+    return MP_ATOMIC_LOAD(&mp->stats.prog_mem);
+}
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+// 各分片的统计值逐项相加
+static void stats_add(MemoryPoolStats* sum, const MemoryPoolStats* st) {
+    int i;
+    sum->total_mem += st->total_mem;
+    sum->used_mem += st->used_mem;
+    sum->prog_mem += st->prog_mem;
+    sum->cache_mem += st->cache_mem;
+    sum->free_mem += st->free_mem;
+    sum->alloc_chunks += st->alloc_chunks;
+    sum->free_chunks += st->free_chunks;
+    sum->block_count += st->block_count;
+    sum->purged_mem += st->purged_mem;
+    sum->committed_mem += st->committed_mem;
+    sum->large_chunks += st->large_chunks;
+    sum->large_mem += st->large_mem;
+    sum->extend_count += st->extend_count;
+    sum->alloc_fails += st->alloc_fails;
+    sum->split_count += st->split_count;
+    sum->merge_count += st->merge_count;
+    sum->remote_frees += st->remote_frees;
+    for (i = 0; i < MP_BIN_COUNT; i++) sum->alloc_hist[i] += st->alloc_hist[i];
+}
+#endif
+
+int MemoryPoolGetStats(MemoryPool* mp, MemoryPoolStats* stats) {
+    if (!mp || !stats) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) {
+        MemoryPoolStats st;
+        unsigned int a;
+        memset(stats, 0, sizeof(*stats));
+        for (a = 0; a < mp->arena_count; a++) {
+            MemoryPoolGetStats(mp->arenas[a], &st);
+            stats_add(stats, &st);
+        }
+        return 0;
+    }
+#endif
+    stats->total_mem = MP_ATOMIC_LOAD(&mp->alloc_mempool_size);
+    stats->used_mem = MP_ATOMIC_LOAD(&mp->stats.used_mem);
+    stats->prog_mem = MP_ATOMIC_LOAD(&mp->stats.prog_mem);
+    stats->cache_mem = MP_ATOMIC_LOAD(&mp->stats.cache_mem);
+    stats->free_mem = stats->total_mem - stats->used_mem;
+    stats->alloc_chunks = MP_ATOMIC_LOAD(&mp->stats.alloc_chunks);
+    stats->free_chunks = MP_ATOMIC_LOAD(&mp->stats.free_chunks);
+    stats->block_count = MP_ATOMIC_LOAD(&mp->stats.block_count);
+    stats->purged_mem = MP_ATOMIC_LOAD(&mp->stats.purged_mem);
+    stats->committed_mem = stats->total_mem - stats->purged_mem;
+    stats->large_chunks = MP_ATOMIC_LOAD(&mp->stats.large_chunks);
+    stats->large_mem = MP_ATOMIC_LOAD(&mp->stats.large_mem);
+    stats->extend_count = MP_ATOMIC_LOAD(&mp->stats.extend_count);
+    stats->alloc_fails = MP_ATOMIC_LOAD(&mp->stats.alloc_fails);
+    stats->split_count = MP_ATOMIC_LOAD(&mp->stats.split_count);
+    stats->merge_count = MP_ATOMIC_LOAD(&mp->stats.merge_count);
+    stats->remote_frees = MP_ATOMIC_LOAD(&mp->stats.remote_frees);
+    int i;
+    for (i = 0; i < MP_BIN_COUNT; i++)
+        stats->alloc_hist[i] = MP_ATOMIC_LOAD(&mp->stats.alloc_hist[i]);
+    return 0;
+}
+
+static inline void frag_info_add(MemoryPoolFragInfo* info, mem_size_t sz) {
+    info->free_mem += sz;
+    info->free_chunks++;
+    if (sz > info->largest_free) info->largest_free = sz;
+    info->free_hist[bin_index(sz)]++;
+}
+
+// 需持有锁. 区域模式下每个内存块未分配的剩余部分算作一个free块
+static void frag_info_locked(MemoryPool* mp, _MP_Memory* mm, MemoryPoolFragInfo* info) {
+    if (mp->policy == MP_POLICY_REGION) {
+        if (mm->alloc_mem < mm->mempool_size) frag_info_add(info, mm->mempool_size - mm->alloc_mem);
+        return;
+    }
+    mem_size_t mask = mm->bin_bitmap;
+    for (; mask; mask &= mask - 1) {
+        _MP_Chunk* ck = mm->free_bins[__builtin_ctzll(mask)];
+        for (; ck; ck = ck->next) frag_info_add(info, MP_CHUNK_SIZE(ck));
+    }
+}
+
+int MemoryPoolGetFragInfo(MemoryPool* mp, _MP_Memory* mm, MemoryPoolFragInfo* info) {
+    if (!mp || !info) return 1;
+    memset(info, 0, sizeof(*info));
+    int found = 0;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) {
+        MemoryPoolFragInfo fi;
+        unsigned int a;
+        int i;
+        for (a = 0; a < mp->arena_count; a++) {
+            if (MemoryPoolGetFragInfo(mp->arenas[a], mm, &fi)) continue;
+            info->free_mem += fi.free_mem;
+            info->free_chunks += fi.free_chunks;
+            if (fi.largest_free > info->largest_free) info->largest_free = fi.largest_free;
+            for (i = 0; i < MP_BIN_COUNT; i++) info->free_hist[i] += fi.free_hist[i];
+            // 每次分配只在一个分区内进行, 各分区分别计算, 取最碎的分区
+            if (fi.frag_index > info->frag_index) info->frag_index = fi.frag_index;
+            found = 1;
+        }
+        return !found;
+    }
+    MP_LOCK(mp);
+#endif
+    _MP_Memory* m = NULL;
+    for (m = mp->mlist; m; m = m->next) {
+        if (mm && m != mm) continue;
+        frag_info_locked(mp, m, info);
+        found = 1;
+    }
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    if (!found) return 1;
+    info->frag_index = info->free_mem ? 1 - (float) info->largest_free / info->free_mem : 0;
+    return 0;
+}
+
+// 需持有锁. 非伙伴模式遍历到末尾哨兵, 伙伴模式的块铺满 mempool_size 中不小于最小块的高位部分
+static int walk_memory_locked(MemoryPool* mp, _MP_Memory* mm, MemoryPoolWalker fn, void* arg) {
+    char* end = (char*) memory_fence(mm);
+    if (mp->policy == MP_POLICY_REGION)
+        end = mm->start + mm->alloc_mem;
+    else if (mp->policy == MP_POLICY_BUDDY)
+        end = mm->start + (mm->mempool_size & ~(((mem_size_t) 1 << MP_BUDDY_MIN_ORDER) - 1));
+
+    MemoryPoolChunkInfo info;
+    info.id = mm->id;
+    _MP_Chunk* ck = (_MP_Chunk*) mm->start;
+    for (; (char*) ck < end; ck = MP_CHUNK_NEXT(ck)) {
+        info.ptr = (char*) ck + MP_CHUNKHEADER;
+        info.size = MP_CHUNK_SIZE(ck);
+        info.free = MP_CHUNK_IS_FREE(ck) ? 1 : 0;
+        if (fn(&info, arg)) return 1;
+    }
+    return 0;
+}
+
+// 需持有锁. 先遍历内存块, 再遍历大对象; 回调要求停止时返回1
+static int walk_locked(MemoryPool* mp, MemoryPoolWalker fn, void* arg) {
+    _MP_Memory* mm = mp->mlist;
+    MemoryPoolChunkInfo info;
+    for (; mm; mm = mm->next)
+        if (walk_memory_locked(mp, mm, fn, arg)) return 1;
+    for (mm = mp->large_list; mm; mm = mm->next) {
+        info.ptr = mm->start + MP_CHUNKHEADER;
+        info.size = mm->mempool_size;
+        info.free = 0;
+        info.id = mm->id;
+        if (fn(&info, arg)) return 1;
+    }
+    return 0;
+}
+
+int MemoryPoolWalk(MemoryPool* mp, MemoryPoolWalker fn, void* arg) {
+    if (!mp || !fn) return 1;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    // 逐个分片加锁遍历
+    unsigned int i;
+    int stop = 0;
+    for (i = 0; i < mp->arena_count && !stop; i++) {
+        MP_LOCK(mp->arenas[i]);
+        stop = walk_locked(mp->arenas[i], fn, arg);
+        MP_UNLOCK(mp->arenas[i]);
+    }
+    if (mp->arenas) return 0;
+    MP_LOCK(mp);
+#endif
+    walk_locked(mp, fn, arg);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return 0;
+}
+
+// 透明大页按 smaps 中每个映射区的 AnonHugePages 与内存块重叠的比例估算
+mem_size_t MemoryPoolGetHugeMemory(MemoryPool* mp) {
+    if (!mp) return 0;
+    mem_size_t huge_mem = 0;
+    int thp = 0;
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) {
+        unsigned int i;
+        for (i = 0; i < mp->arena_count; i++) huge_mem += MemoryPoolGetHugeMemory(mp->arenas[i]);
+        return huge_mem;
+    }
+    MP_LOCK(mp);
+#endif
+    _MP_Memory* mm = NULL;
+    for (mm = mp->mlist; mm; mm = mm->next) {
+        if (mm->huge == MP_HUGE_TLB) huge_mem += memory_map_size(mp, mm);
+        if (mm->huge == MP_HUGE_THP) thp = 1;
+    }
+
+    FILE* fp = thp ? fopen("/proc/self/smaps", "r") : NULL;
+    if (fp) {
+        char line[256];
+        unsigned long a = 0, b = 0;
+        uintptr_t lo = 0, hi = 0, overlap = 0;
+        unsigned long long kb = 0;
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "%lx-%lx ", &a, &b) == 2) {
+                lo = a;
+                hi = b;
+                overlap = 0;
+                for (mm = mp->mlist; mm; mm = mm->next) {
+                    uintptr_t s = (uintptr_t) mm, e = s + memory_map_size(mp, mm);
+                    if (mm->huge != MP_HUGE_THP || e <= lo || s >= hi) continue;
+                    overlap += (e < hi ? e : hi) - (s > lo ? s : lo);
+                }
+            } else if (overlap && sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) {
+                huge_mem += kb * KB * overlap / (hi - lo);
+            }
+        }
+        fclose(fp);
+    }
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MP_UNLOCK(mp);
+#endif
+    return huge_mem;
+}
+
+float MemoryPoolGetUsage(MemoryPool* mp) {
+    return (float) GetUsedMemory(mp) / GetTotalMemory(mp);
+}
+
+float MemoryPoolGetProgUsage(MemoryPool* mp) {
+    return (float) GetProgMemory(mp) / GetTotalMemory(mp);
+}
+
+#undef MP_CHUNKHEADER
+#undef MP_CHUNKEND
+#undef MP_LOCK
+#undef MP_UNLOCK
+#undef MP_TRYLOCK
+#undef MP_TCACHE_CLASS
+#undef MP_TCACHE_NEXT
+#undef MP_TCACHE_SIZE
+#undef MP_FAST_CLASS
+#undef MP_FAST_NEXT
+#undef MP_BUDDY_MIN_ORDER
+#undef MP_ALIGN_SIZE
+#undef MP_ALIGN_UP
+#undef MP_CHUNK_MIN
+#undef MP_FREE_META
+#undef MP_SLAB_SIZE
+#undef MP_PURGE_MIN_SIZE
+#undef MP_SLAB_MIN_OBJS
+#undef MP_SLAB_OF
+#undef MP_ATOMIC_ADD
+#undef MP_ATOMIC_SUB
+#undef MP_ATOMIC_LOAD
+#undef MP_ATOMIC_STORE
+#undef MP_STAT_ADD
+#undef MP_CHUNK_PROG_SIZE
+#undef MP_SEGMENT_SHIFT
+#undef MP_SEGMENT_SIZE
+#undef MP_PAGEMAP_BITS
+#undef MP_PAGEMAP_SIZE
+#undef MP_INIT_MEMORY_STRUCT
+#undef MP_DLINKLIST_INS_FRT
+#undef MP_DLINKLIST_DEL
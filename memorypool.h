@@ -1,82 +1,325 @@
-#ifndef _Z_MEMORYPOOL_H_
-#define _Z_MEMORYPOOL_H_
-
-#ifdef _Z_MEMORYPOOL_THREAD_
-#include <pthread.h>
-#endif
-
-#include <stdlib.h>
-#include <string.h>
-#include <stdint.h>
-
-#define mem_size_t unsigned long long
-#define KB (mem_size_t)(1 << 10)
-#define MB (mem_size_t)(1 << 20)
-#define GB (mem_size_t)(1 << 30)
-
-typedef struct _mp_chunk {
-    mem_size_t alloc_mem;
-    struct _mp_chunk *prev, *next;
-    int is_free;
-} _MP_Chunk;
-
-typedef struct _mp_mempool_list {
-    char* start;
-    unsigned int id;
-    mem_size_t mempool_size;       // 固定值 每个内存池最大内存
-    mem_size_t alloc_mem;          // 统计值 当前池内已分配的内存总大小
-    mem_size_t alloc_prog_mem;     // 统计值 当前池内实际分配给应用程序的内存总大小(减去内存管理元信息)
-    _MP_Chunk *free_list, *alloc_list;
-    struct _mp_mempool_list* next;
-} _MP_Memory;
-
-typedef struct _mp_mempool {
-    unsigned int last_id;
-    int auto_extend;
-    mem_size_t mempool_size;       // 固定值 每个内存池最大内存
-    mem_size_t max_mempool_size;   // 固定值 所有内存池加和总上限
-    mem_size_t alloc_mempool_size; // 统计值 当前已分配的内存池总大小
-    struct _mp_mempool_list* mlist;
-#ifdef _Z_MEMORYPOOL_THREAD_
-    pthread_mutex_t lock;
-#endif
-} MemoryPool;
-
-/*
- *  内部工具函数(调试用)
- */
-
-// 所有Memory的数量
-void get_memory_list_count(MemoryPool* mp, mem_size_t* mlist_len);
-// 每个Memory的统计信息
-void get_memory_info(MemoryPool* mp,
-                     _MP_Memory* mm,
-                     mem_size_t* free_list_len,
-                     mem_size_t* alloc_list_len);
-int get_memory_id(_MP_Memory* mm);
-
-/*
- *  内存池API
- */
-
-MemoryPool* MemoryPoolInit(mem_size_t maxmempoolsize, mem_size_t mempoolsize);
-void* MemoryPoolAlloc(MemoryPool* mp, mem_size_t wantsize);
-int MemoryPoolFree(MemoryPool* mp, void* p);
-MemoryPool* MemoryPoolClear(MemoryPool* mp);
-int MemoryPoolDestroy(MemoryPool* mp);
-int MemoryPoolSetThreadSafe(MemoryPool* mp, int thread_safe);
-
-/*
- *  内存池信息API
- */
-
-// 总空间
-mem_size_t GetTotalMemory(MemoryPool* mp);
-// 实际分配空间
-mem_size_t GetUsedMemory(MemoryPool* mp);
-float MemoryPoolGetUsage(MemoryPool* mp);
-// 数据占用空间
-mem_size_t GetProgMemory(MemoryPool* mp);
-float MemoryPoolGetProgUsage(MemoryPool* mp);
-
-#endif  // !_Z_MEMORYPOOL_H_
+#ifndef _Z_MEMORYPOOL_H_
+#define _Z_MEMORYPOOL_H_
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+#include <pthread.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define mem_size_t unsigned long long
+#define KB (mem_size_t)(1 << 10)
+#define MB (mem_size_t)(1 << 20)
+#define GB (mem_size_t)(1 << 30)
+
+// free块按size class分桶, 每个2的幂区间再分两档, 共64个桶(位图用一个mem_size_t)
+#define MP_BIN_COUNT 64
+
+// 内存分配策略
+#define MP_POLICY_FIRST_FIT 0  // 分桶free链表(默认)
+#define MP_POLICY_BUDDY 1      // 伙伴系统, 分配大小向上取整为2的幂
+#define MP_POLICY_REGION 2     // 区域分配, 移动指针分配, 单个块不回收, 用保存点整体回退
+#define MP_POLICY_BEST_FIT 3   // 按(大小, 地址)有序的最佳适配, O(log n)找到最小的满足块, 最小块48字节
+
+// 分片内存池中线程选择分片的方式(仅线程安全模式)
+#define MP_ARENA_ROUND_ROBIN 0  // 线程首次使用时轮流分配, 之后固定(默认)
+#define MP_ARENA_CPU 1          // 按当前运行的CPU选择
+#define MP_ARENA_MAX 64
+
+// 不小于此大小的申请直接映射独立的内存区域(大对象), 释放时立即归还系统
+#define MP_LARGE_THRESHOLD (1 * MB)
+
+// 延迟合并: 不超过 MP_FAST_MAX_SIZE(含管理信息)的块释放时先进入快速复用桶, 按块大小精确分类, 不与相邻块合并
+// 分配失败, 桶中总大小超过 MP_FAST_MAX_MEM, 归还内存或调用 MemoryPoolCompact 时才整体合并
+#define MP_FAST_MAX_SIZE 512
+#define MP_FAST_MAX_MEM (256 * KB)
+
+// 打开持久化内存池的方式(MemoryPoolOptions.open_flags)
+#define MP_OPEN_RECOVER 1  // 文件上次未正常关闭时按块头重建free桶与统计后打开, 不设置则拒绝打开
+// 持久化内存池创建时默认的映射地址, 远离堆与系统选择的映射区; 被本进程占用时按文件大小依次向后尝试
+#define MP_FILE_BASE 0x500000000000ULL
+#define MP_FILE_BASE_TRIES 64
+
+// 大页方式
+#define MP_HUGE_NONE 0  // 普通页
+#define MP_HUGE_THP 1   // madvise(MADV_HUGEPAGE) 透明大页
+#define MP_HUGE_TLB 2   // MAP_HUGETLB 预留大页, 失败时退回 MP_HUGE_THP
+#define MP_HUGE_PAGE_SIZE (2 * MB)
+
+// free块的页归还状态
+#define MP_PURGE_NONE 0  // 常驻内存
+#define MP_PURGE_IDLE 1  // 上一次衰减检查时已经空闲
+#define MP_PURGE_DONE 2  // 数据区整页已通过madvise归还系统
+
+// 块头标志位, 块大小按 sizeof(long) 对齐, 低3位用于标志
+#define MP_CHUNK_FREE 1       // 空闲
+#define MP_CHUNK_PREV_FREE 2  // 前一个块空闲, 其块尾有效(仅非伙伴模式)
+#define MP_CHUNK_ZERO 4       // 数据区内容全为0(从系统获得后从未分配给程序使用过, free块的链表/树指针与块尾除外)
+#define MP_CHUNK_FLAGS 7
+
+// 已分配块只有8字节块头, 数据区一直到块末尾
+// free块在数据区开头存放链表指针, 最后8字节为块尾(块大小 | 页归还状态 MP_PURGE_*)
+typedef struct _mp_chunk {
+    mem_size_t head;                // 块大小 | MP_CHUNK_*
+    struct _mp_chunk *prev, *next;  // 仅free块有效
+} _MP_Chunk;
+
+typedef struct _mp_mempool_list {
+    struct _mp_mempool* pool;      // 所属内存池
+    char* start;
+    unsigned int id;
+    mem_size_t mempool_size;       // 固定值 每个内存池最大内存
+    mem_size_t commit_size;        // 已提交(可访问)的大小, 延迟提交模式之外等于 mempool_size
+    mem_size_t alloc_mem;          // 统计值 当前池内已分配的内存总大小
+    mem_size_t alloc_prog_mem;     // 统计值 当前池内实际分配给应用程序的内存总大小(减去内存管理元信息)
+    mem_size_t bin_bitmap;         // 非空free桶位图
+    int huge;                      // 实际使用的大页方式 MP_HUGE_*
+    int large;                     // 大对象独占的内存区域, 只有一个块
+    mem_size_t alloc_chunks;       // 统计值 当前池内已分配块数
+    _MP_Chunk* free_bins[MP_BIN_COUNT];
+    _MP_Chunk* free_trees[MP_BIN_COUNT];  // 最佳适配模式下每个桶的free块按(大小, 地址)组成的树堆
+    struct _mp_mempool_list* next;
+    struct _mp_mempool_list* prev;  // 仅大对象链表使用
+} _MP_Memory;
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+// 线程缓存参数
+#define MP_TCACHE_MAX_SIZE (1 * KB)  // 不超过此大小(含管理信息)的块进入线程缓存
+#define MP_TCACHE_MAX_COUNT 64       // 每种大小最多缓存的块数
+#define MP_TCACHE_BATCH 16           // 批量填充/归还的块数
+
+typedef struct _mp_thread_cache _MP_ThreadCache;
+#endif
+
+struct _mp_mempool;
+
+// 对象缓存中的slab, 位于slab起始处, slab按 slab_size 对齐
+typedef struct _mp_slab {
+    struct _mp_cache* cache;
+    struct _mp_slab *prev, *next;
+    void* free_list;     // 已释放对象组成的链表(指针存放在对象内)
+    unsigned int inuse;  // 已分配对象数
+    unsigned int carved; // 已从slab中切出过的对象数
+} _MP_Slab;
+
+// 固定大小对象缓存, 对象不带管理信息
+typedef struct _mp_cache {
+    struct _mp_mempool* mp;
+    mem_size_t obj_size;          // 对象大小(按对齐取整)
+    mem_size_t slab_size;         // slab大小, 2的幂
+    mem_size_t first_offset;      // 第一个对象在slab内的偏移
+    unsigned int slab_objs;       // 每个slab的对象数
+    unsigned int empty_count;     // 保留的空slab数
+    _MP_Slab *partial, *full, *empty;
+    struct _mp_cache *prev, *next;  // 挂在所属内存池上
+#ifdef _Z_MEMORYPOOL_THREAD_
+    pthread_mutex_t lock;
+#endif
+} MemoryPoolCache;
+
+typedef struct _mp_mempool_options {
+    mem_size_t max_mempool_size;   // 所有内存池加和总上限
+    mem_size_t mempool_size;       // 每个内存池大小
+    int policy;                    // MP_POLICY_*
+    int lazy_commit;               // 非0时一次性预留 max_mempool_size 的地址空间, 先提交 mempool_size, 之后按需提交(仅首次适配与最佳适配)
+    int huge_pages;                // MP_HUGE_*, 内存块按大页对齐并取整
+    int arenas;                    // 分片数量, >1时拆成多个独立加锁的子内存池(仅线程安全模式, 不支持区域分配与延迟提交)
+    int arena_mode;                // MP_ARENA_*
+    mem_size_t large_threshold;    // 大对象阈值, 0为 MP_LARGE_THRESHOLD; 放不进内存块的申请总是按大对象分配(区域分配除外)
+    int defer_merge;               // 非0时小块释放后延迟合并(区域分配忽略)
+    mem_size_t min_align;          // 分配结果的最小对齐(2的幂, 不超过页大小), 0为 sizeof(long)
+    int open_flags;                // MP_OPEN_*, 只用于 MemoryPoolOpen 打开已有文件
+    void* map_addr;                // 只用于 MemoryPoolOpen 创建文件: 映射地址(按1MB对齐), 被占用时创建失败; NULL为从 MP_FILE_BASE 起选取
+} MemoryPoolOptions;
+
+// 内存池统计信息, 由分配释放路径增量维护, 读取无需加锁
+typedef struct _mp_mempool_stats {
+    mem_size_t total_mem;     // 所有内存块与大对象总大小
+    mem_size_t used_mem;      // 已分配(含管理信息, 线程缓存与快速复用桶中的块)
+    mem_size_t prog_mem;      // 实际分配给应用程序(减去管理信息, 线程缓存与快速复用桶)
+    mem_size_t cache_mem;     // 线程缓存与快速复用桶中的块
+    mem_size_t free_mem;      // 空闲
+    mem_size_t alloc_chunks;  // 已分配块数
+    mem_size_t free_chunks;   // 空闲块数
+    mem_size_t block_count;   // 内存块(_MP_Memory)数
+    mem_size_t purged_mem;    // free块中已归还系统的页(仍计入total_mem)
+    mem_size_t committed_mem; // 实际占用的内存 total_mem - purged_mem
+    mem_size_t large_chunks;  // 大对象个数(计入 alloc_chunks)
+    mem_size_t large_mem;     // 大对象总大小(计入 total_mem 与 used_mem)
+    // 以下为累计值, MemoryPoolClear 不清零
+    mem_size_t extend_count;  // 自动扩展内存块次数(延迟提交模式下为追加提交次数)
+    mem_size_t alloc_fails;   // 内存池空间不足导致的分配失败次数
+    mem_size_t split_count;   // free块切分次数
+    mem_size_t merge_count;   // 相邻free块合并次数
+    mem_size_t remote_frees;  // 释放时锁被占用, 经无锁栈延迟释放的块数(仅线程安全模式)
+    // 每次分配按块大小计数, 分档与free桶相同, 第i档下限为 (2 + i % 2) << (i / 2 + 3)
+    // 线程缓存命中先记在线程内, 该线程下次加锁(填充, 归还, 退出)时才计入
+    mem_size_t alloc_hist[MP_BIN_COUNT];
+} MemoryPoolStats;
+
+// 碎片信息, 由 MemoryPoolGetFragInfo 加锁遍历free桶得到, 线程缓存与快速复用桶中的块算作已分配
+typedef struct _mp_mempool_frag_info {
+    mem_size_t free_mem;      // free块总大小(含管理信息)
+    mem_size_t free_chunks;   // free块数
+    mem_size_t largest_free;  // 最大free块大小, 不超过 largest_free - 8 的分配一定能成功
+    float frag_index;         // 外部碎片指数 1 - largest_free / free_mem, 0为没有碎片, 越接近1越碎; 多分区时取各分区中最大的
+    mem_size_t free_hist[MP_BIN_COUNT];  // free块按大小计数, 分档同 alloc_hist
+} MemoryPoolFragInfo;
+
+// 堆遍历时每个块的信息
+typedef struct _mp_chunk_info {
+    void* ptr;         // 数据区地址, 已分配块即为分配时返回的指针
+    mem_size_t size;   // 块大小(含管理信息)
+    int free;          // 1为free块, 0为已分配(含线程缓存, 快速复用桶与对象缓存占用的块)
+    unsigned int id;   // 所属内存块id
+} MemoryPoolChunkInfo;
+
+// 返回非0时停止遍历. 遍历期间持有内存池的锁, 回调中不能调用本内存池的接口
+typedef int (*MemoryPoolWalker)(const MemoryPoolChunkInfo* info, void* arg);
+
+// 区域模式的保存点, 由 MemoryPoolMark 填写
+typedef struct _mp_mempool_marker {
+    struct _mp_mempool_list* mm;  // 当时的当前内存块
+    unsigned int id;
+    mem_size_t alloc_mem;
+    mem_size_t alloc_prog_mem;
+    mem_size_t alloc_chunks;
+} MemoryPoolMarker;
+
+typedef struct _mp_mempool {
+    unsigned int last_id;
+    int auto_extend;
+    int policy;
+    int lazy_commit;
+    int huge_pages;
+    mem_size_t mempool_size;       // 固定值 每个内存池最大内存
+    mem_size_t max_mempool_size;   // 固定值 所有内存池加和总上限
+    mem_size_t alloc_mempool_size; // 统计值 当前已分配的内存池总大小
+    MemoryPoolStats stats;         // 统计值 (total_mem/free_mem 在读取时计算)
+    struct _mp_mempool_list* mlist;
+    struct _mp_mempool_list* region;     // 区域模式下当前分配的内存块, NULL为尚未分配
+    struct _mp_mempool_list* large_list; // 大对象
+    mem_size_t large_threshold;          // 不小于此大小的申请按大对象分配
+    int defer_merge;
+    mem_size_t min_align;                // 块大小取整的粒度, 所有块的数据区都按此对齐
+    _MP_Chunk* fast_bins[MP_FAST_MAX_SIZE / sizeof(long) + 1];  // 延迟合并的块, 对内存块而言仍是已分配块
+    mem_size_t fast_mem;                 // 快速复用桶中块的总大小
+    struct _mp_mempool_list*** pagemap;  // 地址 -> 所属内存块 的两级索引
+    MemoryPoolCache* cache_list;         // 所有对象缓存
+    unsigned int decay_ms;               // 自动归还内存的周期(毫秒), 0为关闭
+    mem_size_t last_decay;               // 上一次衰减检查的时间(毫秒)
+    mem_size_t file_size;                // 持久化内存池的文件大小, 0为普通内存池
+    void* root;                          // 应用数据的入口, 持久化内存池重新打开后由此取回
+#ifdef _Z_MEMORYPOOL_THREAD_
+    pthread_mutex_t lock;
+    unsigned int slot;             // 线程私有表中的下标, 所有内存池共用一个 pthread key
+    mem_size_t slot_seq;           // 取得槽位时的序号, 槽位复用后旧的表项失效
+    unsigned int tcache_gen;       // MemoryPoolClear 时递增, 使所有线程缓存失效
+    _MP_ThreadCache* tcache_list;  // 所有线程缓存, 用于销毁
+    _MP_Chunk* remote_free;        // 释放时锁被占用的块组成的无锁栈, 下一次持有锁分配时整批释放
+    struct _mp_mempool* parent;    // 分片所属的内存池, NULL为独立内存池
+    struct _mp_mempool** arenas;   // 分片, 非NULL时本内存池只负责分发, 不持有内存块
+    unsigned int arena_count;
+    unsigned int arena_next;       // 轮流分配的下一个分片
+    int arena_mode;
+#endif
+} MemoryPool;
+
+/*
+ *  内部工具函数(调试用)
+ */
+
+// 所有Memory的数量
+void get_memory_list_count(MemoryPool* mp, mem_size_t* mlist_len);
+// 每个Memory的统计信息
+void get_memory_info(MemoryPool* mp,
+                     _MP_Memory* mm,
+                     mem_size_t* free_list_len,
+                     mem_size_t* alloc_list_len);
+int get_memory_id(_MP_Memory* mm);
+
+/*
+ *  内存池API
+ */
+
+MemoryPool* MemoryPoolInit(mem_size_t maxmempoolsize, mem_size_t mempoolsize);
+MemoryPool* MemoryPoolInitEx(const MemoryPoolOptions* opt);
+// 持久化内存池: 内存块为文件的共享映射, MemoryPoolDestroy 关闭并保留文件, 之后可重新打开继续使用
+// 文件不存在或为空时按 opt 创建(opt 为NULL则只打开已有文件); 不支持延迟提交, 大页, 分片, 大对象与对象缓存
+// 进程异常退出后文件保持未关闭状态, 需在 opt->open_flags 中设置 MP_OPEN_RECOVER 才能打开:
+// 按块头重建free桶, 当时在线程缓存与快速复用桶中的块无法找回, 仍算作已分配; 块头损坏时返回NULL
+MemoryPool* MemoryPoolOpen(const char* path, const MemoryPoolOptions* opt);
+// 入口指针随内存池保存, 持久化内存池映射到固定地址, 指向池内的指针重新打开后仍有效
+void* MemoryPoolGetRoot(MemoryPool* mp);
+int MemoryPoolSetRoot(MemoryPool* mp, void* root);
+void* MemoryPoolAlloc(MemoryPool* mp, mem_size_t wantsize);
+// 行为与系统calloc一致, 已知为0的内存跳过清零
+void* MemoryPoolCalloc(MemoryPool* mp, mem_size_t n, mem_size_t size);
+// 返回按 alignment(2的幂) 对齐的内存, 同样使用 MemoryPoolFree 释放
+void* MemoryPoolAllocAligned(MemoryPool* mp, mem_size_t wantsize, mem_size_t alignment);
+// 优先吸收相邻的free块原地扩大, 或原地切分缩小, 都不行时才重新分配并拷贝
+void* MemoryPoolRealloc(MemoryPool* mp, void* p, mem_size_t wantsize);
+int MemoryPoolFree(MemoryPool* mp, void* p);
+// 块实际可用的字节数(不小于申请大小), 不属于本内存池或已释放时返回0
+mem_size_t MemoryPoolUsableSize(MemoryPool* mp, void* p);
+// 批量分配, 只加一次锁并尽量从同一个free块连续切分, 大对象单独映射; 返回成功分配的个数, 失败的位置为NULL
+int MemoryPoolAllocBatch(MemoryPool* mp, const mem_size_t sizes[], int n, void* out[]);
+// 批量释放, 只加一次锁, 相邻块一次合并; ptrs 会按地址重新排序, 返回非法指针个数
+int MemoryPoolFreeBatch(MemoryPool* mp, void* ptrs[], int n);
+MemoryPool* MemoryPoolClear(MemoryPool* mp);
+int MemoryPoolDestroy(MemoryPool* mp);
+int MemoryPoolSetThreadSafe(MemoryPool* mp, int thread_safe);
+// 将当前线程的缓存归还内存池(线程退出时自动归还)
+int MemoryPoolFlushThreadCache(MemoryPool* mp);
+// 当前线程的缓存归还内存池, 并立即合并快速复用桶中的块, 返回合并的字节数
+mem_size_t MemoryPoolCompact(MemoryPool* mp);
+// 将空闲内存归还系统: 释放完全空闲的扩展内存块, 大块free内存的整页madvise归还; 返回归还的字节数
+mem_size_t MemoryPoolTrim(MemoryPool* mp);
+// 释放时每隔 decay_ms 毫秒检查一次, 归还已空闲超过一个周期的内存; 0为关闭(默认)
+int MemoryPoolSetDecay(MemoryPool* mp, unsigned int decay_ms);
+// 区域模式: 记录当前分配位置; 回退到保存点, 释放之后分配的所有内存(之后的保存点随之失效)
+int MemoryPoolMark(MemoryPool* mp, MemoryPoolMarker* mark);
+int MemoryPoolRewind(MemoryPool* mp, const MemoryPoolMarker* mark);
+
+/*
+ *  对象缓存API: 固定大小对象, 无逐对象管理信息, O(1)分配释放
+ */
+
+// slab 放不进一个内存块(对象过大或内存块过小)时返回NULL
+MemoryPoolCache* MemoryPoolCacheCreate(MemoryPool* mp, mem_size_t obj_size, mem_size_t align);
+void* MemoryPoolCacheAlloc(MemoryPoolCache* cache);
+int MemoryPoolCacheFree(MemoryPoolCache* cache, void* p);
+int MemoryPoolCacheDestroy(MemoryPoolCache* cache);
+
+/*
+ *  内存池信息API
+ */
+
+// 总空间
+mem_size_t GetTotalMemory(MemoryPool* mp);
+// 实际分配空间
+mem_size_t GetUsedMemory(MemoryPool* mp);
+float MemoryPoolGetUsage(MemoryPool* mp);
+// 数据占用空间
+mem_size_t GetProgMemory(MemoryPool* mp);
+float MemoryPoolGetProgUsage(MemoryPool* mp);
+// 统计信息快照, 不加锁, 各字段分别原子读取
+int MemoryPoolGetStats(MemoryPool* mp, MemoryPoolStats* stats);
+// 碎片信息, mm 为NULL时统计整个内存池, 否则只统计该内存块
+int MemoryPoolGetFragInfo(MemoryPool* mp, _MP_Memory* mm, MemoryPoolFragInfo* info);
+// 逐个内存块按地址顺序遍历所有块(区域模式下为已分配部分), 加锁进行, 较慢
+int MemoryPoolWalk(MemoryPool* mp, MemoryPoolWalker fn, void* arg);
+// 实际由大页承载的内存(MAP_HUGETLB 内存块 + /proc/self/smaps 中的透明大页), 需读取系统信息, 较慢
+mem_size_t MemoryPoolGetHugeMemory(MemoryPool* mp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // !_Z_MEMORYPOOL_H_
@@ -0,0 +1,97 @@
+#ifndef _Z_MEMORYPOOL_HPP_
+#define _Z_MEMORYPOOL_HPP_
+
+/*
+ *  C++ 适配层(仅头文件): 让STL容器使用 MemoryPool
+ *  MemoryPoolAllocator<T>  标准库分配器, 类型的大小与对齐在编译期确定
+ *  MemoryPoolResource      std::pmr::memory_resource 子类(需要C++17)
+ *  两者都不持有内存池, 内存池须比使用它的容器活得更久; 分配失败抛出 std::bad_alloc
+ */
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define _Z_MEMORYPOOL_PMR_
+#endif
+#endif
+
+#include "memorypool.h"
+
+namespace memorypool {
+
+// 对齐不超过块头自然对齐(sizeof(long))时走普通分配, 小块由线程缓存直接取得
+// 0字节按1字节分配, 标准要求此时也返回可释放的非空指针
+inline void* pool_allocate(MemoryPool* mp, std::size_t bytes, std::size_t alignment) {
+    if (!bytes) bytes = 1;
+    void* p = alignment <= sizeof(long) ? MemoryPoolAlloc(mp, bytes)
+                                        : MemoryPoolAllocAligned(mp, bytes, alignment);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+template <class T>
+class MemoryPoolAllocator {
+   public:
+    typedef T value_type;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    explicit MemoryPoolAllocator(MemoryPool* mp) noexcept : mp_(mp) {}
+    template <class U>
+    MemoryPoolAllocator(const MemoryPoolAllocator<U>& other) noexcept : mp_(other.pool()) {}
+
+    T* allocate(size_type n) {
+        if (n > (size_type) -1 / sizeof(T)) throw std::bad_alloc();
+        // 对齐是编译期常量, 内联后只剩一次普通分配(或对齐分配)的调用
+        return static_cast<T*>(pool_allocate(mp_, n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T* p, size_type) noexcept { MemoryPoolFree(mp_, p); }
+
+    MemoryPool* pool() const noexcept { return mp_; }
+
+    // 容器拷贝/移动/交换时分配器随之传播, 不同内存池的容器之间交换元素仍然安全
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+   private:
+    MemoryPool* mp_;
+};
+
+template <class T, class U>
+inline bool operator==(const MemoryPoolAllocator<T>& a, const MemoryPoolAllocator<U>& b) noexcept {
+    return a.pool() == b.pool();
+}
+template <class T, class U>
+inline bool operator!=(const MemoryPoolAllocator<T>& a, const MemoryPoolAllocator<U>& b) noexcept {
+    return a.pool() != b.pool();
+}
+
+#ifdef _Z_MEMORYPOOL_PMR_
+class MemoryPoolResource : public std::pmr::memory_resource {
+   public:
+    explicit MemoryPoolResource(MemoryPool* mp) noexcept : mp_(mp) {}
+    MemoryPool* pool() const noexcept { return mp_; }
+
+   protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return pool_allocate(mp_, bytes, alignment);
+    }
+    void do_deallocate(void* p, std::size_t, std::size_t) override { MemoryPoolFree(mp_, p); }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        const MemoryPoolResource* r = dynamic_cast<const MemoryPoolResource*>(&other);
+        return r && r->mp_ == mp_;
+    }
+
+   private:
+    MemoryPool* mp_;
+};
+#endif
+
+}  // namespace memorypool
+
+#endif  // !_Z_MEMORYPOOL_HPP_
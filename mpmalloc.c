@@ -0,0 +1,191 @@
+/*
+ *  LD_PRELOAD 替换系统 malloc: LD_PRELOAD=./libmpmalloc.so ./a.out
+ *  需与 memorypool.c 一起按线程安全模式编译为共享库(make build_preload)
+ *
+ *  - 内存池在第一次分配时创建, 参数读取环境变量:
+ *      MP_MALLOC_MAX_SIZE    总上限(MB), 默认 16384
+ *      MP_MALLOC_BLOCK_SIZE  每个内存块大小(MB), 默认 64
+ *      MP_MALLOC_POLICY      MP_POLICY_*, 默认首次适配
+ *      MP_MALLOC_ARENAS      分片数量, 默认不分片
+ *  - 内存池创建期间以及内存池自身管理结构的分配(同一线程重入)交给glibc
+ *  - 内存池已满的请求同样交给glibc; 释放时按地址索引区分, 不属于内存池的指针交还glibc
+ *  - 内存池按 max_align_t 对齐(min_align), 与glibc malloc相同
+ *  - fork 前持有内存池的所有锁, 子进程中重新初始化
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memorypool.h"
+
+#ifndef _Z_MEMORYPOOL_THREAD_
+#error "mpmalloc.c requires -D _Z_MEMORYPOOL_THREAD_"
+#endif
+
+#define MP_EXPORT __attribute__((visibility("default")))
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* p);
+
+static MemoryPool* g_mp = NULL;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static size_t (*libc_usable_size)(void*) = NULL;
+// 当前线程正在内存池内部, 期间的分配(如线程缓存, 地址索引)直接交给glibc
+static __thread int in_pool __attribute__((tls_model("initial-exec"))) = 0;
+
+static mem_size_t env_size(const char* name, mem_size_t def) {
+    const char* s = getenv(name);
+    return s && *s ? strtoull(s, NULL, 10) : def;
+}
+
+// fork 时内存池不能处于加锁修改的中途
+static void lock_all(MemoryPool* mp) {
+    unsigned int i;
+    for (i = 0; i < mp->arena_count; i++) pthread_mutex_lock(&mp->arenas[i]->lock);
+    pthread_mutex_lock(&mp->lock);
+}
+
+static void unlock_all(MemoryPool* mp) {
+    unsigned int i;
+    pthread_mutex_unlock(&mp->lock);
+    for (i = 0; i < mp->arena_count; i++) pthread_mutex_unlock(&mp->arenas[i]->lock);
+}
+
+static void fork_prepare(void) {
+    if (g_mp) lock_all(g_mp);
+}
+
+static void fork_parent(void) {
+    if (g_mp) unlock_all(g_mp);
+}
+
+// 子进程中只剩fork的线程, 直接重新初始化锁
+static void fork_child(void) {
+    unsigned int i;
+    if (!g_mp) return;
+    for (i = 0; i < g_mp->arena_count; i++) pthread_mutex_init(&g_mp->arenas[i]->lock, NULL);
+    pthread_mutex_init(&g_mp->lock, NULL);
+}
+
+static void pool_init(void) {
+    MemoryPoolOptions opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.max_mempool_size = env_size("MP_MALLOC_MAX_SIZE", 16384) * MB;
+    opt.mempool_size = env_size("MP_MALLOC_BLOCK_SIZE", 64) * MB;
+    opt.policy = (int) env_size("MP_MALLOC_POLICY", MP_POLICY_FIRST_FIT);
+    opt.arenas = (int) env_size("MP_MALLOC_ARENAS", 0);
+    // malloc 的结果须满足任意基本类型的对齐(x86-64 上为16字节)
+    opt.min_align = _Alignof(max_align_t);
+    // 区域分配不回收单个块, 不适合作为通用malloc
+    if (opt.policy == MP_POLICY_REGION) opt.policy = MP_POLICY_FIRST_FIT;
+
+    in_pool++;
+    libc_usable_size = (size_t(*)(void*)) dlsym(RTLD_NEXT, "malloc_usable_size");
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    g_mp = MemoryPoolInitEx(&opt);
+    in_pool--;
+}
+
+// 返回NULL时由调用者交给glibc
+static MemoryPool* pool(void) {
+    if (in_pool) return NULL;
+    pthread_once(&g_once, pool_init);
+    return g_mp;
+}
+
+MP_EXPORT void* malloc(size_t size) {
+    MemoryPool* mp = pool();
+    void* p = NULL;
+    if (mp) {
+        in_pool++;
+        p = MemoryPoolAlloc(mp, size);
+        in_pool--;
+    }
+    return p ? p : __libc_malloc(size);
+}
+
+MP_EXPORT void* calloc(size_t n, size_t size) {
+    MemoryPool* mp = pool();
+    void* p = NULL;
+    if (mp) {
+        in_pool++;
+        p = MemoryPoolCalloc(mp, n, size);
+        in_pool--;
+    }
+    return p ? p : __libc_calloc(n, size);
+}
+
+MP_EXPORT void free(void* p) {
+    int ret = 1;
+    if (!p) return;
+    if (g_mp) {
+        in_pool++;
+        ret = MemoryPoolFree(g_mp, p);
+        in_pool--;
+    }
+    if (ret) __libc_free(p);
+}
+
+MP_EXPORT size_t malloc_usable_size(void* p) {
+    mem_size_t sz = 0;
+    if (!p) return 0;
+    if (g_mp) sz = MemoryPoolUsableSize(g_mp, p);
+    if (sz) return (size_t) sz;
+    return libc_usable_size ? libc_usable_size(p) : 0;
+}
+
+MP_EXPORT void* realloc(void* p, size_t size) {
+    MemoryPool* mp = pool();
+    mem_size_t old = 0;
+    void* np = NULL;
+    if (!p) return malloc(size);
+    if (mp) old = MemoryPoolUsableSize(mp, p);
+    if (!old) return __libc_realloc(p, size);
+    if (!size) {
+        free(p);
+        return NULL;
+    }
+
+    in_pool++;
+    np = MemoryPoolRealloc(mp, p, size);
+    in_pool--;
+    if (np) return np;
+    // 内存池放不下时搬到glibc
+    if (!(np = __libc_malloc(size))) return NULL;
+    memcpy(np, p, old < size ? old : size);
+    free(p);
+    return np;
+}
+
+MP_EXPORT int posix_memalign(void** out, size_t alignment, size_t size) {
+    MemoryPool* mp = NULL;
+    void* p = NULL;
+    if (!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void*)) return EINVAL;
+    if ((mp = pool())) {
+        in_pool++;
+        p = MemoryPoolAllocAligned(mp, size, alignment);
+        in_pool--;
+    }
+    if (!p && !(p = __libc_memalign(alignment, size))) return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+MP_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    void* p = NULL;
+    int ret = posix_memalign(&p, alignment < sizeof(void*) ? sizeof(void*) : alignment, size);
+    if (ret) errno = ret;
+    return p;
+}
+
+MP_EXPORT void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
@@ -1,7 +1,10 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 #include <algorithm>
 
 #include "memorypool.h"  // 注释这行比较系统malloc与memory pool的性能
@@ -42,20 +45,1232 @@
                MemoryPoolGetProgUsage(mp));                               \
         get_memory_list_count(mp, &mlist_cnt);                            \
         printf("->> [memorypool_list_count] mlist(%llu)\n", mlist_cnt);   \
-        _MP_Memory* mlist = mp->mlist;                                    \
-        while (mlist) {                                                   \
-            get_memory_info(mp, mlist, &free_cnt, &alloc_cnt);            \
-            printf("->>> id: %d [list_count] free_list(%llu)  "           \
-                   "alloc_list(%llu)\n",                                  \
-                   get_memory_id(mlist),                                  \
-                   free_cnt,                                              \
-                   alloc_cnt);                                            \
-            mlist = mlist->next;                                          \
+        for (int ai = 0; ai < arena_count(mp); ai++) {                    \
+            _MP_Memory* mlist = arena_at(mp, ai)->mlist;                  \
+            while (mlist) {                                               \
+                get_memory_info(mp, mlist, &free_cnt, &alloc_cnt);        \
+                printf("->>> arena: %d id: %d [list_count] "              \
+                       "free_list(%llu)  alloc_list(%llu)\n",             \
+                       ai,                                                \
+                       get_memory_id(mlist),                              \
+                       free_cnt,                                          \
+                       alloc_cnt);                                        \
+                mlist = mlist->next;                                      \
+            }                                                             \
         }                                                                 \
         printf("============ %lu ============\n\n",                       \
                (unsigned long) pthread_self());                           \
     } while (0)
 
+#ifdef _Z_MEMORYPOOL_H_  // 分片内存池的内存块挂在各个分片上
+int arena_count(MemoryPool* mp) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) return (int) mp->arena_count;
+#endif
+    return 1;
+}
+MemoryPool* arena_at(MemoryPool* mp, int i) {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (mp->arenas) return mp->arenas[i];
+#endif
+    return mp;
+}
+#endif
+
+#ifdef _Z_MEMORYPOOL_H_  // 功能检查, 失败时直接退出
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "memorypool.hpp"
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("CHECK failed: %s (%s:%d)\n", #cond, __FILE__, __LINE__);   \
+            exit(1);                                                           \
+        }                                                                      \
+    } while (0)
+
+// 堆遍历得到的块数与大小应与统计一致(区域模式的对齐填充在遍历中是free块, 不检查free部分)
+struct WalkSum {
+    mem_size_t chunks[2], bytes[2];
+};
+
+int walk_sum(const MemoryPoolChunkInfo* info, void* arg) {
+    WalkSum* w = (WalkSum*) arg;
+    w->chunks[info->free]++;
+    w->bytes[info->free] += info->size;
+    return 0;
+}
+
+void check_stats(MemoryPool* mp) {
+    WalkSum w = {};
+    MemoryPoolStats st;
+    MemoryPoolFragInfo fi;
+    CHECK(MemoryPoolWalk(mp, walk_sum, &w) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.alloc_chunks == w.chunks[0] && st.used_mem == w.bytes[0]);
+    CHECK(st.prog_mem + st.cache_mem <= st.used_mem && st.used_mem <= st.total_mem);
+    if (mp->policy == MP_POLICY_REGION) return;
+    CHECK(MemoryPoolGetFragInfo(mp, NULL, &fi) == 0);
+    CHECK(st.free_chunks == w.chunks[1] && fi.free_chunks == w.chunks[1] && fi.free_mem == w.bytes[1]);
+    CHECK(w.bytes[1] <= st.free_mem);
+}
+
+// 全部释放并归还线程缓存后只剩每个内存块各一个free块(伙伴模式为初始切分出的块)
+void check_empty(MemoryPool* mp) {
+    MemoryPoolStats st;
+    CHECK(MemoryPoolFlushThreadCache(mp) == 0);
+    check_stats(mp);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.alloc_chunks == 0 && st.used_mem == 0 && st.prog_mem == 0 && st.cache_mem == 0);
+    if (mp->policy != MP_POLICY_BUDDY) CHECK(st.free_chunks == st.block_count);
+}
+
+// 分桶free链表: 各种大小交错分配释放后统计与堆遍历一致, 全部释放后相邻块合并回整块
+void check_size_bins() {
+    MemoryPool* mp = MemoryPoolInit(64 * MB, 8 * MB);
+    CHECK(mp != NULL);
+    void* p[1000];
+    MemoryPoolFragInfo fi;
+    for (int i = 0; i < 1000; i++) {
+        p[i] = MemoryPoolAlloc(mp, (i * 37) % 5000 + 1);
+        CHECK(p[i] != NULL);
+    }
+    check_stats(mp);
+    for (int i = 0; i < 1000; i += 2) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    CHECK(MemoryPoolFlushThreadCache(mp) == 0);
+    check_stats(mp);
+    CHECK(MemoryPoolGetFragInfo(mp, NULL, &fi) == 0);
+    CHECK(fi.free_chunks > 1 && fi.frag_index > 0);
+    // 空洞按大小分桶, 再次申请同样的大小不需要扩展内存块
+    for (int i = 0; i < 1000; i += 2) {
+        p[i] = MemoryPoolAlloc(mp, (i * 37) % 5000 + 1);
+        CHECK(p[i] != NULL && MemoryPoolUsableSize(mp, p[i]) >= (mem_size_t) (i * 37) % 5000 + 1);
+    }
+    check_stats(mp);
+    CHECK(mp->mlist->next == NULL);
+    for (int i = 0; i < 1000; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+}
+
+int walk_buddy(const MemoryPoolChunkInfo* info, void* arg) {
+    mem_size_t off = (char*) info->ptr - 8 - (char*) arg;
+    CHECK((info->size & (info->size - 1)) == 0 && off % info->size == 0);
+    return 0;
+}
+
+// 伙伴系统: 所有块都是2的幂且按自身大小对齐, 全部释放后合并回初始的块
+void check_buddy() {
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 8 * MB;
+    opt.policy = MP_POLICY_BUDDY;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+    CHECK(mp != NULL);
+    MemoryPoolStats st;
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    mem_size_t init_free = st.free_chunks;
+    void* p[500];
+    for (int i = 0; i < 500; i++) {
+        p[i] = MemoryPoolAlloc(mp, (i * 53) % 3000 + 1);
+        CHECK(p[i] != NULL);
+    }
+    CHECK(MemoryPoolUsableSize(mp, p[1]) == 64 - 8);
+    CHECK(MemoryPoolWalk(mp, walk_buddy, mp->mlist->start) == 0);
+    check_stats(mp);
+    for (int i = 0; i < 500; i += 3) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    CHECK(MemoryPoolFlushThreadCache(mp) == 0);
+    CHECK(MemoryPoolWalk(mp, walk_buddy, mp->mlist->start) == 0);
+    check_stats(mp);
+    for (int i = 0; i < 500; i++)
+        if (i % 3) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    check_empty(mp);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.free_chunks == init_free && st.merge_count > 0);
+    MemoryPoolDestroy(mp);
+}
+
+void* tcache_thread(void* arg) {
+    MemoryPool* mp = (MemoryPool*) arg;
+    void* p[100];
+    for (int i = 0; i < 100; i++) CHECK((p[i] = MemoryPoolAlloc(mp, 16 + i % 5 * 8)) != NULL);
+    for (int i = 0; i < 100; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    return NULL;
+}
+
+// 线程缓存: 小块释放后留在本线程缓存中, 线程退出或主动归还时回到内存池;
+// 所有内存池共用一个线程私有key, 同时存在的内存池个数不受 PTHREAD_KEYS_MAX 限制
+void check_thread_cache() {
+#ifdef _Z_MEMORYPOOL_THREAD_
+    MemoryPool* mp = MemoryPoolInit(64 * MB, 8 * MB);
+    CHECK(mp != NULL);
+    MemoryPoolStats st;
+    void* p = MemoryPoolAlloc(mp, 100);
+    CHECK(p != NULL && MemoryPoolFree(mp, p) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.cache_mem > 0);
+    // 同样大小的申请直接从缓存取回
+    CHECK(MemoryPoolAlloc(mp, 100) == p && MemoryPoolFree(mp, p) == 0);
+    check_stats(mp);
+    check_empty(mp);
+
+    pthread_t tid;
+    CHECK(pthread_create(&tid, NULL, tcache_thread, mp) == 0 && pthread_join(tid, NULL) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+
+    const int n = 1200;
+    MemoryPool** pools = (MemoryPool**) malloc(n * sizeof(MemoryPool*));
+    for (int i = 0; i < n; i++) {
+        CHECK((pools[i] = MemoryPoolInit(256 * KB, 256 * KB)) != NULL);
+        CHECK((p = MemoryPoolAlloc(pools[i], 64)) != NULL && MemoryPoolFree(pools[i], p) == 0);
+        CHECK(MemoryPoolGetStats(pools[i], &st) == 0 && st.cache_mem > 0);
+    }
+    // 槽位复用后新内存池看不到旧内存池的线程缓存
+    MemoryPoolDestroy(pools[5]);
+    CHECK((pools[5] = MemoryPoolInit(256 * KB, 256 * KB)) != NULL);
+    CHECK(MemoryPoolGetStats(pools[5], &st) == 0 && st.cache_mem == 0 && st.alloc_chunks == 0);
+    CHECK((p = MemoryPoolAlloc(pools[5], 64)) != NULL && MemoryPoolFree(pools[5], p) == 0);
+    check_empty(pools[5]);
+    for (int i = 0; i < n; i++) MemoryPoolDestroy(pools[i]);
+    free(pools);
+#endif
+}
+
+MemoryPool* make_pool(int policy) {
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 8 * MB;
+    opt.policy = policy;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+    CHECK(mp != NULL);
+    return mp;
+}
+
+// 对齐分配: 各种对齐与大小的结果都满足对齐, 前面切下的部分还给free桶, 释放后统计一致
+void check_aligned(int policy) {
+    MemoryPool* mp = make_pool(policy);
+    void* p[300];
+    for (int i = 0; i < 300; i++) {
+        mem_size_t align = (mem_size_t) 16 << (i % 13), size = (i * 71) % 4000 + 1;
+        p[i] = MemoryPoolAllocAligned(mp, size, align);
+        CHECK(p[i] != NULL && (uintptr_t) p[i] % align == 0 && MemoryPoolUsableSize(mp, p[i]) >= size);
+        memset(p[i], 0xab, size);
+    }
+    CHECK(MemoryPoolAllocAligned(mp, 100, 48) == NULL);
+    check_stats(mp);
+    for (int i = 0; i < 300; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+}
+
+// 原地调整: 后一块空闲时原地扩大, 缩小总是原地, 都不行时搬到新块并保留内容
+void check_realloc(int policy) {
+    MemoryPool* mp = make_pool(policy);
+    char* a = (char*) MemoryPoolAlloc(mp, 2000);
+    char* b = (char*) MemoryPoolAlloc(mp, 2000);
+    char* c = (char*) MemoryPoolAlloc(mp, 2000);
+    char* d = (char*) MemoryPoolAlloc(mp, 2000);
+    CHECK(a && b && c && d);
+    for (int i = 0; i < 2000; i++) a[i] = c[i] = (char) i;
+    CHECK(MemoryPoolFree(mp, b) == 0);
+    if (policy != MP_POLICY_BUDDY) CHECK(MemoryPoolRealloc(mp, a, 3500) == a);
+    CHECK(MemoryPoolRealloc(mp, a, 100) == a);
+    check_stats(mp);
+    char* nc = (char*) MemoryPoolRealloc(mp, c, 100000);
+    CHECK(nc != NULL && nc != c);
+    for (int i = 0; i < 2000; i++) CHECK(nc[i] == (char) i && a[i % 100] == (char) (i % 100));
+    check_stats(mp);
+    void* e = MemoryPoolRealloc(mp, NULL, 10);
+    CHECK(e != NULL && MemoryPoolRealloc(mp, e, 0) == NULL);
+    CHECK(MemoryPoolFree(mp, a) == 0 && MemoryPoolFree(mp, nc) == 0 && MemoryPoolFree(mp, d) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+}
+
+// calloc: 跳过清零只能用于从未交给程序的内存, 写脏后释放再分配的内存必须清零
+void check_calloc(int policy) {
+    MemoryPool* mp = make_pool(policy);
+    char* p[200];
+    for (int i = 0; i < 200; i++) {
+        CHECK((p[i] = (char*) MemoryPoolCalloc(mp, i + 1, 37)) != NULL);
+        for (int j = 0; j < (i + 1) * 37; j++) CHECK(p[i][j] == 0);
+        memset(p[i], 0xff, (i + 1) * 37);
+    }
+    for (int i = 0; i < 200; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    CHECK(MemoryPoolFlushThreadCache(mp) == 0);
+    for (int i = 0; i < 200; i++) {
+        CHECK((p[i] = (char*) MemoryPoolCalloc(mp, 37, i + 1)) != NULL);
+        for (int j = 0; j < (i + 1) * 37; j++) CHECK(p[i][j] == 0);
+    }
+    CHECK(MemoryPoolCalloc(mp, (mem_size_t) 1 << 40, (mem_size_t) 1 << 40) == NULL);
+    check_stats(mp);
+    for (int i = 0; i < 200; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+}
+
+// 归还内存: 扩展出的空闲内存块整块释放, 大块free内存整页归还, 之后重新分配的内存仍可正常使用
+void check_trim() {
+    MemoryPool* mp = make_pool(MP_POLICY_FIRST_FIT);
+    MemoryPoolStats st;
+    void* p[12];
+    for (int i = 0; i < 12; i++) CHECK((p[i] = MemoryPoolAlloc(mp, 900 * KB)) != NULL);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.block_count == 2 && st.extend_count == 1);
+    for (int i = 0; i < 12; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    CHECK(MemoryPoolTrim(mp) > 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.block_count == 1);
+    CHECK(st.purged_mem > 0 && st.committed_mem == st.total_mem - st.purged_mem);
+    check_empty(mp);
+    char* q = (char*) MemoryPoolCalloc(mp, 1, 900 * KB);
+    CHECK(q != NULL);
+    for (mem_size_t i = 0; i < 900 * KB; i += 512) CHECK(q[i] == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.purged_mem < 8 * MB);
+    CHECK(MemoryPoolFree(mp, q) == 0);
+    MemoryPoolDestroy(mp);
+
+    // 衰减: 空闲超过一个周期的内存在之后的释放中自动归还
+    mp = make_pool(MP_POLICY_FIRST_FIT);
+    CHECK(MemoryPoolSetDecay(mp, 1) == 0);
+    // 小块与大块之间隔一个已分配块, 释放小块不会与大的free块合并
+    void* small[100];
+    for (int i = 0; i < 100; i++) CHECK((small[i] = MemoryPoolAlloc(mp, 2000)) != NULL);
+    void* fence = MemoryPoolAlloc(mp, 2000);
+    for (int i = 0; i < 3; i++) CHECK((p[i] = MemoryPoolAlloc(mp, 900 * KB)) != NULL);
+    for (int i = 0; i < 3; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    for (int i = 0; i < 100; i++) {
+        usleep(2000);
+        CHECK(MemoryPoolFree(mp, small[i]) == 0);
+        CHECK(MemoryPoolGetStats(mp, &st) == 0);
+        if (st.purged_mem) {
+            while (++i < 100) CHECK(MemoryPoolFree(mp, small[i]) == 0);
+            break;
+        }
+    }
+    CHECK(st.purged_mem > 0);
+    CHECK(MemoryPoolFree(mp, fence) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+}
+
+// 延迟提交: 只有一个预留了全部地址空间的内存块, 随使用量增长提交, 归还时撤销末尾空闲部分的提交
+void check_lazy_commit(int policy) {
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 1 * MB;
+    opt.policy = policy;
+    opt.lazy_commit = 1;
+    opt.large_threshold = 32 * MB;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+    CHECK(mp != NULL);
+    MemoryPoolStats st;
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.total_mem < 4 * MB);
+    void* p[20];
+    for (int i = 0; i < 20; i++) {
+        CHECK((p[i] = MemoryPoolAlloc(mp, 900 * KB)) != NULL);
+        memset(p[i], i, 900 * KB);
+    }
+    void* big = MemoryPoolAlloc(mp, 5 * MB);
+    CHECK(big != NULL);
+    memset(big, 1, 5 * MB);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.block_count == 1 && st.extend_count > 0);
+    CHECK(st.total_mem >= 22 * MB && st.total_mem <= 64 * MB);
+    check_stats(mp);
+    mem_size_t committed = st.total_mem;
+    for (int i = 0; i < 20; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    CHECK(MemoryPoolFree(mp, big) == 0);
+    CHECK(MemoryPoolTrim(mp) > 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.total_mem < committed);
+    check_empty(mp);
+    CHECK((big = MemoryPoolCalloc(mp, 1, 5 * MB)) != NULL && ((char*) big)[5 * MB - 1] == 0);
+    CHECK(MemoryPoolFree(mp, big) == 0);
+    MemoryPoolDestroy(mp);
+}
+
+int walk_min_chunk(const MemoryPoolChunkInfo* info, void* arg) {
+    if (!info->free) CHECK(info->size == *(mem_size_t*) arg);
+    return 0;
+}
+
+struct SwapArg {
+    MemoryPool* mp;
+    pthread_mutex_t* lock;
+    void** slot;  // 与其他线程交换的一半指针
+    unsigned int seed;
+};
+
+void* swap_thread(void* arg) {
+    SwapArg* a = (SwapArg*) arg;
+    void *mine[256], *theirs[128];
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < 256; i++) {
+            mem_size_t sz = rand_r(&a->seed) % 600 + 1;
+            CHECK((mine[i] = MemoryPoolAlloc(a->mp, sz)) != NULL);
+            memset(mine[i], i, sz);
+        }
+        pthread_mutex_lock(a->lock);
+        for (int i = 0; i < 128; i++) {
+            theirs[i] = a->slot[i];
+            a->slot[i] = mine[128 + i];
+        }
+        pthread_mutex_unlock(a->lock);
+        for (int i = 0; i < 128; i++) {
+            CHECK(MemoryPoolFree(a->mp, mine[i]) == 0);
+            if (theirs[i]) CHECK(MemoryPoolFree(a->mp, theirs[i]) == 0);
+        }
+    }
+    return NULL;
+}
+
+// 已分配块只有8字节块头; 线程安全模式下多个线程交叉分配释放相邻的小块, 块头与前一块空闲标志不会互相覆盖
+void check_chunk_header() {
+    MemoryPool* mp = make_pool(MP_POLICY_FIRST_FIT);
+    void* p[100];
+    mem_size_t min_chunk = 32;
+    for (int i = 0; i < 100; i++)
+        CHECK((p[i] = MemoryPoolAlloc(mp, 24)) != NULL && MemoryPoolUsableSize(mp, p[i]) == 24);
+    CHECK(MemoryPoolWalk(mp, walk_min_chunk, &min_chunk) == 0);
+    check_stats(mp);
+    for (int i = 0; i < 100; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    check_empty(mp);
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    void* slot[128] = {};
+    SwapArg args[4];
+    pthread_t tid[4];
+    for (int i = 0; i < 4; i++) {
+        args[i] = SwapArg{mp, &lock, slot, (unsigned int) i + 1};
+        CHECK(pthread_create(&tid[i], NULL, swap_thread, &args[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++) CHECK(pthread_join(tid[i], NULL) == 0);
+    for (int i = 0; i < 128; i++) CHECK(MemoryPoolFree(mp, slot[i]) == 0);
+    MemoryPoolTrim(mp);
+    check_empty(mp);
+#endif
+    MemoryPoolDestroy(mp);
+}
+
+// 区域模式: 回退到保存点后统计恢复到保存时, 之后分配的内存被复用; 回退到更早的保存点后之后的保存点失效
+void check_region_rewind() {
+    MemoryPool* mp = make_pool(MP_POLICY_REGION);
+    MemoryPoolMarker m0, m1;
+    MemoryPoolStats st0, st1, st;
+    CHECK(MemoryPoolMark(mp, &m0) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st0) == 0);
+    for (int i = 0; i < 100; i++) CHECK(MemoryPoolAlloc(mp, i * 13 + 1) != NULL);
+    CHECK(MemoryPoolMark(mp, &m1) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st1) == 0);
+    check_stats(mp);
+
+    // 跨越多个内存块
+    void* first = MemoryPoolAlloc(mp, 1000);
+    CHECK(first != NULL);
+    for (int i = 0; i < 30; i++) CHECK(MemoryPoolAlloc(mp, 700 * KB) != NULL);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.block_count > 1);
+    check_stats(mp);
+
+    CHECK(MemoryPoolRewind(mp, &m1) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.used_mem == st1.used_mem && st.prog_mem == st1.prog_mem &&
+          st.alloc_chunks == st1.alloc_chunks);
+    check_stats(mp);
+    CHECK(MemoryPoolAlloc(mp, 1000) == first);
+
+    CHECK(MemoryPoolRewind(mp, &m0) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.used_mem == st0.used_mem && st.alloc_chunks == 0);
+    check_stats(mp);
+    CHECK(MemoryPoolRewind(mp, &m1) == 1);
+
+    MemoryPoolDestroy(mp);
+    mp = make_pool(MP_POLICY_FIRST_FIT);
+    CHECK(MemoryPoolMark(mp, &m0) == 1 && MemoryPoolRewind(mp, &m0) == 1);
+    MemoryPoolDestroy(mp);
+}
+
+mem_size_t hist_sum(const MemoryPoolStats& st) {
+    mem_size_t sum = 0;
+    for (int i = 0; i < MP_BIN_COUNT; i++) sum += st.alloc_hist[i];
+    return sum;
+}
+
+int walk_stop(const MemoryPoolChunkInfo* info, void* arg) {
+    return ++*(int*) arg == 5;
+}
+
+// 统计计数器: 线程缓存命中也计入 alloc_hist; 碎片信息按内存块统计之和等于整体; 遍历回调返回非0时停止
+void check_counters() {
+    MemoryPool* mp = MemoryPoolInit(64 * MB, 1 * MB);
+    CHECK(mp != NULL);
+    MemoryPoolStats st0, st;
+    MemoryPoolFragInfo fi, fm;
+    CHECK(MemoryPoolGetStats(mp, &st0) == 0);
+    for (int i = 0; i < 10000; i++) CHECK(MemoryPoolFree(mp, MemoryPoolAlloc(mp, 40)) == 0);
+    CHECK(MemoryPoolFlushThreadCache(mp) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(hist_sum(st) - hist_sum(st0) == 10000);
+
+    void* p[3000];
+    for (int i = 0; i < 3000; i++) CHECK((p[i] = MemoryPoolAlloc(mp, i % 1400 + 1)) != NULL);
+    for (int i = 0; i < 3000; i += 2) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    CHECK(MemoryPoolFlushThreadCache(mp) == 0);
+    check_stats(mp);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.block_count > 1 && st.extend_count == st.block_count - 1);
+    CHECK(st.split_count > st0.split_count && st.merge_count > st0.merge_count);
+    CHECK(hist_sum(st) - hist_sum(st0) == 13000);
+
+    CHECK(MemoryPoolGetFragInfo(mp, NULL, &fi) == 0);
+    mem_size_t free_mem = 0, free_chunks = 0, hist = 0;
+    for (_MP_Memory* mm = mp->mlist; mm; mm = mm->next) {
+        CHECK(MemoryPoolGetFragInfo(mp, mm, &fm) == 0);
+        CHECK(fm.largest_free <= fi.largest_free);
+        free_mem += fm.free_mem;
+        free_chunks += fm.free_chunks;
+    }
+    for (int i = 0; i < MP_BIN_COUNT; i++) hist += fi.free_hist[i];
+    CHECK(free_mem == fi.free_mem && free_chunks == fi.free_chunks && hist == fi.free_chunks);
+    CHECK(fi.frag_index > 0 && fi.frag_index < 1);
+    CHECK(fi.frag_index == 1 - (float) fi.largest_free / fi.free_mem);
+
+    int n = 0;
+    CHECK(MemoryPoolWalk(mp, walk_stop, &n) == 0 && n == 5);
+    for (int i = 1; i < 3000; i += 2) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    check_empty(mp);
+    CHECK(MemoryPoolGetFragInfo(mp, NULL, &fi) == 0 && fi.frag_index > 0);
+    MemoryPoolDestroy(mp);
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+    // 多分区: 只有当前线程的分区有碎片, 整体碎片指数取最碎的分区, 不被其他分区的free块稀释
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 1 * MB;
+    opt.arenas = 4;
+    CHECK((mp = MemoryPoolInitEx(&opt)) != NULL);
+    for (int i = 0; i < 3000; i++) CHECK((p[i] = MemoryPoolAlloc(mp, i % 1400 + 1)) != NULL);
+    for (int i = 0; i < 3000; i += 2) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    CHECK(MemoryPoolFlushThreadCache(mp) == 0);
+    float worst = 0;
+    free_mem = 0;
+    for (unsigned int i = 0; i < mp->arena_count; i++) {
+        CHECK(MemoryPoolGetFragInfo(mp->arenas[i], NULL, &fm) == 0);
+        if (fm.frag_index > worst) worst = fm.frag_index;
+        free_mem += fm.free_mem;
+    }
+    CHECK(MemoryPoolGetFragInfo(mp, NULL, &fi) == 0);
+    CHECK(fi.free_mem == free_mem && fi.frag_index == worst);
+    CHECK(fi.frag_index > 1 - (float) fi.largest_free / fi.free_mem);
+    for (int i = 1; i < 3000; i += 2) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    check_stats(mp);
+    MemoryPoolDestroy(mp);
+#endif
+}
+
+// 最佳适配在所有内存块中选最小的满足块: 新扩展的内存块排在前面且有大的free块, 仍然填回旧内存块中的小空洞
+void check_best_fit() {
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 8 * MB;
+    opt.mempool_size = 1 * MB;
+    opt.policy = MP_POLICY_BEST_FIT;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+    CHECK(mp != NULL);
+    void* a = MemoryPoolAlloc(mp, 2000);
+    void* b = MemoryPoolAlloc(mp, 2000);
+    void* x = MemoryPoolAlloc(mp, 900 * KB);
+    CHECK(a && b && x);
+    CHECK(MemoryPoolFree(mp, a) == 0);
+    void* y = MemoryPoolAlloc(mp, 900 * KB);
+    CHECK(y != NULL && mp->mlist->next != NULL);
+    check_stats(mp);
+    CHECK(MemoryPoolAlloc(mp, 2000) == a);
+    check_stats(mp);
+    CHECK(MemoryPoolFree(mp, a) == 0 && MemoryPoolFree(mp, b) == 0);
+    CHECK(MemoryPoolFree(mp, x) == 0 && MemoryPoolFree(mp, y) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+}
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+struct RemoteArg {
+    MemoryPool* mp;
+    pthread_barrier_t* barrier;
+    void** p;
+    int n;
+};
+
+void* remote_thread(void* arg) {
+    RemoteArg* a = (RemoteArg*) arg;
+    // 先建好线程缓存, 之后的释放不需要等锁
+    CHECK(MemoryPoolFree(a->mp, MemoryPoolAlloc(a->mp, 56)) == 0);
+    pthread_barrier_wait(a->barrier);
+    pthread_barrier_wait(a->barrier);
+    for (int i = 0; i < a->n; i++) CHECK(MemoryPoolFree(a->mp, a->p[i]) == 0);
+    pthread_barrier_wait(a->barrier);
+    return NULL;
+}
+
+// 锁被其他线程占用时释放不阻塞, 块进入无锁栈, 下次加锁时整批释放, 统计一致
+void check_remote_free() {
+    MemoryPool* mp = make_pool(MP_POLICY_FIRST_FIT);
+    MemoryPoolStats st0, st;
+    void* p[220];
+    for (int i = 0; i < 220; i++) CHECK((p[i] = MemoryPoolAlloc(mp, i < 200 ? 56 : 4000)) != NULL);
+    CHECK(MemoryPoolGetStats(mp, &st0) == 0);
+
+    pthread_barrier_t barrier;
+    pthread_t tid;
+    RemoteArg arg = {mp, &barrier, p, 220};
+    CHECK(pthread_barrier_init(&barrier, NULL, 2) == 0);
+    CHECK(pthread_create(&tid, NULL, remote_thread, &arg) == 0);
+    pthread_barrier_wait(&barrier);
+    pthread_mutex_lock(&mp->lock);
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    CHECK(mp->remote_free != NULL);
+    pthread_mutex_unlock(&mp->lock);
+    CHECK(pthread_join(tid, NULL) == 0);
+    pthread_barrier_destroy(&barrier);
+
+    MemoryPoolTrim(mp);
+    CHECK(mp->remote_free == NULL);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.remote_frees - st0.remote_frees >= 20 + 128);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+}
+#endif
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+struct ArenaArg {
+    MemoryPool* mp;
+    void* p[2];
+};
+
+void* arena_thread(void* arg) {
+    ArenaArg* a = (ArenaArg*) arg;
+    a->p[0] = MemoryPoolAlloc(a->mp, 2000);
+    a->p[1] = MemoryPoolAlloc(a->mp, 2000);
+    return NULL;
+}
+
+// 指针所在的分片下标
+int arena_index(MemoryPool* mp, void* p) {
+    for (unsigned int i = 0; i < mp->arena_count; i++)
+        for (_MP_Memory* mm = mp->arenas[i]->mlist; mm; mm = mm->next)
+            if ((char*) p >= mm->start && (char*) p < mm->start + mm->mempool_size) return i;
+    return -1;
+}
+
+// 分片: 线程轮流分到不同分片且之后固定, 其他线程释放时归还所属分片; 反复创建销毁不耗尽线程私有数据
+void check_arenas() {
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 1 * MB;
+    opt.arenas = 4;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+    CHECK(mp != NULL && mp->arena_count == 4);
+    ArenaArg args[4];
+    pthread_t tid[4];
+    int used[4] = {};
+    for (int i = 0; i < 4; i++) {
+        args[i].mp = mp;
+        CHECK(pthread_create(&tid[i], NULL, arena_thread, &args[i]) == 0);
+        CHECK(pthread_join(tid[i], NULL) == 0);
+        int idx = arena_index(mp, args[i].p[0]);
+        CHECK(idx >= 0 && idx == arena_index(mp, args[i].p[1]));
+        used[idx]++;
+    }
+    for (int i = 0; i < 4; i++) CHECK(used[i] == 1);
+    check_stats(mp);
+    for (int i = 0; i < 4; i++)
+        CHECK(MemoryPoolFree(mp, args[i].p[0]) == 0 && MemoryPoolFree(mp, args[i].p[1]) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+
+    for (int i = 0; i < 300; i++) {
+        opt.arenas = 2;
+        CHECK((mp = MemoryPoolInitEx(&opt)) != NULL);
+        void* p = MemoryPoolAlloc(mp, 100);
+        CHECK(p != NULL && MemoryPoolFree(mp, p) == 0);
+        MemoryPoolDestroy(mp);
+    }
+}
+#endif
+
+struct alignas(64) Line {
+    char data[64];
+};
+
+// C++适配层: 容器的内存来自内存池, 对齐类型走对齐分配, 0字节分配返回非空指针, 失败抛出 bad_alloc
+void check_cpp_adapter() {
+    using memorypool::MemoryPoolAllocator;
+    MemoryPool* mp = make_pool(MP_POLICY_FIRST_FIT);
+    {
+        std::vector<int, MemoryPoolAllocator<int> > v{MemoryPoolAllocator<int>(mp)};
+        for (int i = 0; i < 10000; i++) v.push_back(i);
+        typedef std::pair<const int, int> Pair;
+        std::map<int, int, std::less<int>, MemoryPoolAllocator<Pair> > m{MemoryPoolAllocator<Pair>(mp)};
+        for (int i = 0; i < 1000; i++) m[i] = i;
+        std::vector<Line, MemoryPoolAllocator<Line> > lines(100, Line(), MemoryPoolAllocator<Line>(mp));
+        CHECK((uintptr_t) lines.data() % 64 == 0);
+        CHECK(v.get_allocator() == MemoryPoolAllocator<Pair>(mp));
+        MemoryPoolStats st;
+        CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.alloc_chunks >= 1000 + 2);
+        check_stats(mp);
+
+        MemoryPoolAllocator<char> a(mp);
+        char* p = a.allocate(0);
+        CHECK(p != NULL);
+        a.deallocate(p, 0);
+        bool thrown = false;
+        try {
+            a.allocate(128 * MB);
+        } catch (const std::bad_alloc&) {
+            thrown = true;
+        }
+        CHECK(thrown);
+    }
+    check_empty(mp);
+
+#ifdef _Z_MEMORYPOOL_PMR_
+    {
+        memorypool::MemoryPoolResource res(mp);
+        std::pmr::vector<std::pmr::string> v(&res);
+        for (int i = 0; i < 1000; i++) v.emplace_back(100, 'x');
+        check_stats(mp);
+        void* p = res.allocate(0, 64);
+        CHECK(p != NULL && (uintptr_t) p % 64 == 0);
+        res.deallocate(p, 0, 64);
+        memorypool::MemoryPoolResource res2(mp);
+        CHECK(res.is_equal(res2) && !res.is_equal(*std::pmr::new_delete_resource()));
+    }
+    check_empty(mp);
+#endif
+    MemoryPoolDestroy(mp);
+}
+
+#ifdef _Z_MEMORYPOOL_THREAD_
+struct PreloadSlot {
+    unsigned char* p;
+    size_t size;
+    unsigned char tag;
+};
+
+void* preload_thread(void* arg) {
+    unsigned int seed = (unsigned int) (uintptr_t) arg;
+    PreloadSlot slots[64] = {};
+    for (int i = 0; i < 20000; i++) {
+        PreloadSlot& sl = slots[rand_r(&seed) % 64];
+        size_t size = rand_r(&seed) % 3000 + 1;
+        unsigned char tag = (unsigned char) (i | 1);
+        void* p = NULL;
+        switch (rand_r(&seed) % 4) {
+            case 0:
+                CHECK((p = malloc(size)) != NULL);
+                break;
+            case 1:
+                CHECK((p = calloc(1, size)) != NULL);
+                for (size_t k = 0; k < size; k++) CHECK(((unsigned char*) p)[k] == 0);
+                break;
+            case 2:
+                CHECK(posix_memalign(&p, 256, size) == 0 && (uintptr_t) p % 256 == 0);
+                break;
+            default:
+                // 原有内容保留到新旧大小中较小的部分
+                CHECK((p = realloc(sl.p, size)) != NULL);
+                for (size_t k = 0; sl.p && k < std::min(size, sl.size); k++)
+                    CHECK(((unsigned char*) p)[k] == sl.tag);
+                sl.p = NULL;
+        }
+        CHECK((uintptr_t) p % 16 == 0 && malloc_usable_size(p) >= size);
+        free(sl.p);
+        memset(p, tag, size);
+        sl = PreloadSlot{(unsigned char*) p, size, tag};
+    }
+    for (int i = 0; i < 64; i++) free(slots[i].p);
+    return NULL;
+}
+
+// LD_PRELOAD 下重新执行本程序时的检查: malloc 系列来自替换库, 多线程与fork后可正常分配释放
+int preload_child() {
+    Dl_info info;
+    CHECK(dladdr(dlsym(RTLD_DEFAULT, "malloc"), &info) && strstr(info.dli_fname, "libmpmalloc"));
+    void* p = malloc(0);
+    CHECK(p != NULL);
+    free(p);
+    CHECK((p = malloc(100 * MB)) != NULL);
+    memset(p, 1, 100 * MB);
+    free(p);
+
+    pthread_t tid[4];
+    for (int i = 0; i < 4; i++)
+        CHECK(pthread_create(&tid[i], NULL, preload_thread, (void*) (uintptr_t) (i + 1)) == 0);
+    pid_t pid = fork();
+    if (pid == 0) {
+        preload_thread((void*) 100);
+        _exit(0);
+    }
+    int status = 0;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    for (int i = 0; i < 4; i++) CHECK(pthread_join(tid[i], NULL) == 0);
+    return 0;
+}
+
+// 编译了替换库(make build_preload)时, 在 LD_PRELOAD 下重新执行本程序做检查, 否则跳过
+void check_preload() {
+    char path[4096];
+    if (!realpath("libmpmalloc.so", path)) return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("LD_PRELOAD", path, 1);
+        execl("/proc/self/exe", "test.out", "preload", (char*) NULL);
+        _exit(127);
+    }
+    int status = 0;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+#endif
+
+// 地址所在的页已解除映射
+bool unmapped(void* p) {
+    unsigned char vec;
+    void* page = (void*) ((uintptr_t) p & ~(uintptr_t) (sysconf(_SC_PAGESIZE) - 1));
+    return mincore(page, 1, &vec) == -1 && errno == ENOMEM;
+}
+
+// 大对象: 单独映射并计入统计, realloc 原地调整映射大小, 缩到阈值以下时搬回内存块, 释放时立即解除映射
+void check_large() {
+    MemoryPool* mp = make_pool(MP_POLICY_FIRST_FIT);
+    MemoryPoolStats st0, st;
+    CHECK(MemoryPoolGetStats(mp, &st0) == 0);
+    char* p = (char*) MemoryPoolAlloc(mp, 2 * MB);
+    CHECK(p != NULL && MemoryPoolUsableSize(mp, p) >= 2 * MB);
+    memset(p, 7, 2 * MB);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.large_chunks == 1 && st.large_mem >= 2 * MB && st.total_mem == st0.total_mem + st.large_mem);
+    check_stats(mp);
+
+    CHECK((p = (char*) MemoryPoolRealloc(mp, p, 6 * MB)) != NULL);
+    for (mem_size_t i = 0; i < 2 * MB; i += 4096) CHECK(p[i] == 7);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.large_chunks == 1 && st.large_mem >= 6 * MB);
+    CHECK((p = (char*) MemoryPoolRealloc(mp, p, 3 * MB / 2)) != NULL);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.large_chunks == 1 && st.large_mem < 2 * MB);
+    check_stats(mp);
+    CHECK((p = (char*) MemoryPoolRealloc(mp, p, 100)) != NULL && p[99] == 7);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.large_chunks == 0 && st.large_mem == 0);
+
+    // 比内存块大的申请同样按大对象分配, 超过总上限失败
+    char* q = (char*) MemoryPoolAlloc(mp, 30 * MB);
+    CHECK(q != NULL && MemoryPoolAlloc(mp, 60 * MB) == NULL);
+    memset(q, 1, 30 * MB);
+    check_stats(mp);
+    CHECK(MemoryPoolFree(mp, q) == 0 && unmapped(q));
+    CHECK(MemoryPoolFree(mp, p) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.large_chunks == 0 && st.large_mem == 0 && st.total_mem == st0.total_mem);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 8 * MB;
+    opt.large_threshold = 64 * KB;
+    CHECK((mp = MemoryPoolInitEx(&opt)) != NULL);
+    CHECK((p = (char*) MemoryPoolAlloc(mp, 100 * KB)) != NULL && (q = (char*) MemoryPoolAlloc(mp, 60 * KB)) != NULL);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.large_chunks == 1);
+    CHECK(MemoryPoolFree(mp, p) == 0 && MemoryPoolFree(mp, q) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+}
+
+// 延迟合并: 小块释放后留在快速复用桶(计入 cache_mem), 同样大小的申请直接复用, 超过上限或 MemoryPoolCompact 时合并
+void check_defer_merge() {
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 8 * MB;
+    opt.defer_merge = 1;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+    CHECK(mp != NULL);
+    MemoryPoolStats st0, st;
+    void* p[2000];
+    CHECK(MemoryPoolGetStats(mp, &st0) == 0);
+    for (int i = 0; i < 200; i++) CHECK((p[i] = MemoryPoolAlloc(mp, 100)) != NULL);
+    for (int i = 0; i < 200; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    CHECK(MemoryPoolFlushThreadCache(mp) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    // 线程安全模式下还有批量填充线程缓存时多取的块
+    CHECK(st.cache_mem >= 200 * 112 && st.cache_mem % 112 == 0 && st.prog_mem == 0);
+    CHECK(st.merge_count == st0.merge_count);
+    check_stats(mp);
+
+    void* q = MemoryPoolAlloc(mp, 100);
+    CHECK(std::find(p, p + 200, q) != p + 200);
+    CHECK(MemoryPoolFree(mp, q) == 0);
+    CHECK(MemoryPoolCompact(mp) == st.cache_mem);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.cache_mem == 0 && st.merge_count > st0.merge_count);
+    check_empty(mp);
+
+    // 桶中总大小超过 MP_FAST_MAX_MEM 时自动合并
+    for (int i = 0; i < 2000; i++) CHECK((p[i] = MemoryPoolAlloc(mp, 400)) != NULL);
+    for (int i = 0; i < 2000; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    CHECK(MemoryPoolFlushThreadCache(mp) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0 && st.cache_mem <= MP_FAST_MAX_MEM);
+    check_stats(mp);
+    MemoryPoolCompact(mp);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+}
+
+// 大页模式下内存块向上取整到2MB, 超出申请大小的部分同样可以分配与释放
+void check_huge_block() {
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 9 * MB;
+    opt.policy = MP_POLICY_REGION;
+    opt.huge_pages = MP_HUGE_THP;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+    CHECK(mp != NULL);
+    _MP_Memory* mm = mp->mlist;
+    CHECK(mm->commit_size == mm->mempool_size && mm->mempool_size > opt.mempool_size);
+
+    char* last = NULL;
+    while (mm->start + mm->alloc_mem + 256 * KB + 8 <= mm->start + mm->mempool_size)
+        last = (char*) MemoryPoolAlloc(mp, 256 * KB);
+    CHECK(last != NULL && last >= mm->start + opt.mempool_size);
+    CHECK(MemoryPoolUsableSize(mp, last) >= 256 * KB);
+    CHECK(MemoryPoolRealloc(mp, last, 128 * KB) == last);
+    CHECK(MemoryPoolFree(mp, last) == 0);
+    MemoryPoolDestroy(mp);
+}
+
+// min_align 为16时普通分配与 MemoryPoolRealloc 的结果都按16字节对齐
+void check_min_align() {
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 8 * MB;
+    opt.min_align = 16;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+    CHECK(mp != NULL);
+    void* p[2000];
+    for (int i = 1; i < 2000; i++) {
+        p[i] = MemoryPoolAlloc(mp, i);
+        CHECK(p[i] != NULL && (uintptr_t) p[i] % 16 == 0);
+    }
+    for (int i = 1; i < 2000; i++) {
+        p[i] = MemoryPoolRealloc(mp, p[i], i * 3);
+        CHECK(p[i] != NULL && (uintptr_t) p[i] % 16 == 0);
+    }
+    for (int i = 1; i < 2000; i++) CHECK(MemoryPoolFree(mp, p[i]) == 0);
+    MemoryPoolDestroy(mp);
+}
+
+// 批量分配: 输出先全部置空, 大对象走单独映射, 尺寸分布按每个块记录
+void check_alloc_batch() {
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 8 * MB;
+    opt.large_threshold = 64 * KB;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+    CHECK(mp != NULL);
+    MemoryPoolStats st;
+    mem_size_t sizes[4] = {100, 200, 300, 400}, hist = 0;
+    void* out[4];
+    CHECK(MemoryPoolAllocBatch(mp, sizes, 4, out) == 4);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    for (int i = 0; i < MP_BIN_COUNT; i++) hist += st.alloc_hist[i];
+    CHECK(hist == 4);
+    CHECK(MemoryPoolFreeBatch(mp, out, 4) == 0);
+
+    sizes[2] = 128 * KB;
+    CHECK(MemoryPoolAllocBatch(mp, sizes, 4, out) == 4);
+    CHECK(MemoryPoolUsableSize(mp, out[2]) >= 128 * KB);
+    CHECK(MemoryPoolFreeBatch(mp, out, 4) == 0);
+
+    sizes[1] = 1 * GB;
+    for (int i = 0; i < 4; i++) out[i] = (void*) 1;
+    CHECK(MemoryPoolAllocBatch(mp, sizes, 4, out) == 1);
+    CHECK(out[0] != NULL && out[1] == NULL && out[2] == NULL && out[3] == NULL);
+    CHECK(MemoryPoolFree(mp, out[0]) == 0);
+    MemoryPoolDestroy(mp);
+}
+
+// 对象缓存只接受自己分配的对象, 不属于内存池的指针直接拒绝, 不读取其所在的slab头
+void check_cache_free() {
+    MemoryPool* mp = MemoryPoolInit(64 * MB, 8 * MB);
+    CHECK(mp != NULL);
+    MemoryPoolCache* cache = MemoryPoolCacheCreate(mp, 48, 0);
+    MemoryPoolCache* other = MemoryPoolCacheCreate(mp, 48, 0);
+    CHECK(cache != NULL && other != NULL);
+    void* obj = MemoryPoolCacheAlloc(cache);
+    void* heap = malloc(64);
+    int local = 0;
+    CHECK(obj != NULL && heap != NULL);
+    CHECK(MemoryPoolCacheFree(cache, heap) == 1);
+    CHECK(MemoryPoolCacheFree(cache, &local) == 1);
+    CHECK(MemoryPoolCacheFree(other, obj) == 1);
+    CHECK(MemoryPoolCacheFree(cache, obj) == 0);
+    free(heap);
+    CHECK(MemoryPoolCacheDestroy(other) == 0 && MemoryPoolCacheDestroy(cache) == 0);
+
+    // slab 放不进内存块时创建失败, 能创建的缓存一定能分配
+    CHECK(MemoryPoolCacheCreate(mp, 16 * MB, 0) == NULL);
+    CHECK(MemoryPoolCacheCreate(mp, 3 * MB, 0) == NULL);
+    CHECK((cache = MemoryPoolCacheCreate(mp, 1 * MB, 0)) != NULL);
+    void* big[2] = {MemoryPoolCacheAlloc(cache), MemoryPoolCacheAlloc(cache)};
+    CHECK(big[0] != NULL && big[1] != NULL && big[0] != big[1]);
+    check_stats(mp);
+    CHECK(MemoryPoolCacheFree(cache, big[0]) == 0 && MemoryPoolCacheFree(cache, big[1]) == 0);
+    CHECK(MemoryPoolCacheDestroy(cache) == 0);
+    check_empty(mp);
+    MemoryPoolDestroy(mp);
+
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = 64 * MB;
+    opt.mempool_size = 8 * MB;
+    opt.policy = MP_POLICY_BUDDY;
+    CHECK((mp = MemoryPoolInitEx(&opt)) != NULL);
+    CHECK(MemoryPoolCacheCreate(mp, 1 * MB, 0) == NULL);
+    CHECK((cache = MemoryPoolCacheCreate(mp, 512 * KB, 0)) != NULL);
+    CHECK((obj = MemoryPoolCacheAlloc(cache)) != NULL && MemoryPoolCacheFree(cache, obj) == 0);
+    CHECK(MemoryPoolCacheDestroy(cache) == 0);
+    MemoryPoolDestroy(mp);
+}
+
+// 持久化内存池: 关闭后重新打开, 入口指针与池内链表保持不变; 进程异常退出后以 MP_OPEN_RECOVER 恢复
+struct PNode {
+    PNode* next;
+    int val;
+};
+
+int count_chunk(const MemoryPoolChunkInfo* info, void* arg) {
+    ((mem_size_t*) arg)[info->free]++;
+    return 0;
+}
+
+int list_length(PNode* n) {
+    int len = 0;
+    for (; n; n = n->next) len++;
+    return len;
+}
+
+void check_persistent(int policy) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mp_test_%d.pool", (int) getpid());
+    unlink(path);
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = opt.mempool_size = 4 * MB;
+    opt.policy = policy;
+    MemoryPool* mp = MemoryPoolOpen(path, &opt);
+    CHECK(mp != NULL);
+    PNode *head = NULL, *n = NULL;
+    for (int i = 0; i < 100; i++) {
+        n = (PNode*) MemoryPoolAlloc(mp, sizeof(PNode) + i);
+        CHECK(n != NULL);
+        n->val = i;
+        n->next = head;
+        head = n;
+    }
+    CHECK(MemoryPoolSetRoot(mp, head) == 0);
+    CHECK(MemoryPoolOpen(path, NULL) == NULL);  // 同一文件同时只能打开一次
+    CHECK(MemoryPoolDestroy(mp) == 0);
+
+    // 重新打开后继续分配释放: 去掉偶数节点, 再加入50个
+    mp = MemoryPoolOpen(path, NULL);
+    CHECK(mp != NULL);
+    head = (PNode*) MemoryPoolGetRoot(mp);
+    CHECK(list_length(head) == 100 && head->val == 99);
+    for (PNode** pn = &head; *pn;) {
+        n = *pn;
+        if (n->val % 2) {
+            pn = &n->next;
+            continue;
+        }
+        *pn = n->next;
+        CHECK(MemoryPoolFree(mp, n) == 0);
+    }
+    for (int i = 0; i < 50; i++) {
+        n = (PNode*) MemoryPoolAlloc(mp, sizeof(PNode) + i * 7);
+        CHECK(n != NULL);
+        n->val = 100 + i;
+        n->next = head;
+        head = n;
+    }
+    CHECK(MemoryPoolSetRoot(mp, head) == 0);
+    CHECK(MemoryPoolDestroy(mp) == 0);
+
+    // 子进程修改后不关闭直接退出
+    pid_t pid = fork();
+    if (pid == 0) {
+        mp = MemoryPoolOpen(path, NULL);
+        if (!mp) _exit(1);
+        head = (PNode*) MemoryPoolGetRoot(mp);
+        for (int i = 0; i < 10; i++) {
+            MemoryPoolFree(mp, MemoryPoolAlloc(mp, 1000));
+            n = (PNode*) MemoryPoolAlloc(mp, sizeof(PNode));
+            n->val = 1000 + i;
+            n->next = head;
+            head = n;
+        }
+        MemoryPoolSetRoot(mp, head);
+        _exit(0);
+    }
+    int status = 0;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    CHECK(MemoryPoolOpen(path, NULL) == NULL);
+    opt.open_flags = MP_OPEN_RECOVER;
+    mp = MemoryPoolOpen(path, &opt);
+    CHECK(mp != NULL);
+    head = (PNode*) MemoryPoolGetRoot(mp);
+    CHECK(list_length(head) == 110 && head->val == 1009);
+
+    // 重建后的统计与块头一致
+    MemoryPoolStats st;
+    mem_size_t cnt[2] = {0, 0};
+    CHECK(MemoryPoolWalk(mp, count_chunk, cnt) == 0);
+    CHECK(MemoryPoolGetStats(mp, &st) == 0);
+    CHECK(st.alloc_chunks == cnt[0] && st.free_chunks == cnt[1]);
+
+    while (head) {
+        n = head;
+        head = head->next;
+        CHECK(MemoryPoolFree(mp, n) == 0);
+    }
+    void* big = MemoryPoolAlloc(mp, 1 * MB);
+    CHECK(big != NULL && MemoryPoolFree(mp, big) == 0);
+    CHECK(MemoryPoolSetRoot(mp, NULL) == 0);
+    CHECK(MemoryPoolDestroy(mp) == 0);
+
+    // 恢复后正常关闭的文件不需要再恢复
+    mp = MemoryPoolOpen(path, NULL);
+    CHECK(mp != NULL && MemoryPoolGetRoot(mp) == NULL);
+    CHECK(MemoryPoolDestroy(mp) == 0);
+    unlink(path);
+}
+
+// 在 check_persistent_exec 重新执行的进程中打开: 地址布局与创建文件的进程无关, 链表仍可直接访问
+int reopen_child(const char* path) {
+    MemoryPool* mp = MemoryPoolOpen(path, NULL);
+    CHECK(mp != NULL);
+    PNode* head = (PNode*) MemoryPoolGetRoot(mp);
+    int val = 99;
+    for (PNode* n = head; n; n = n->next) CHECK(n->val == val--);
+    CHECK(val == -1);
+    for (int i = 0; i < 20; i++) {
+        PNode* n = (PNode*) MemoryPoolAlloc(mp, sizeof(PNode));
+        CHECK(n != NULL);
+        n->val = 200 + i;
+        n->next = head;
+        head = n;
+    }
+    CHECK(MemoryPoolSetRoot(mp, head) == 0);
+    CHECK(MemoryPoolDestroy(mp) == 0);
+    return 0;
+}
+
+// 映射地址: 默认从 MP_FILE_BASE 起选取, 可以指定; 另一个进程(exec, 地址随机化重新进行)打开同一文件
+void check_persistent_exec() {
+    char path[64], path2[64];
+    snprintf(path, sizeof(path), "/tmp/mp_test_%d.pool", (int) getpid());
+    snprintf(path2, sizeof(path2), "/tmp/mp_test_%d_2.pool", (int) getpid());
+    unlink(path);
+    unlink(path2);
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = opt.mempool_size = 4 * MB;
+    MemoryPool* mp = MemoryPoolOpen(path, &opt);
+    CHECK(mp != NULL && (uintptr_t) mp >= MP_FILE_BASE && (uintptr_t) mp < MP_FILE_BASE + MB);
+    // 默认地址被占用时向后选取
+    MemoryPool* mp2 = MemoryPoolOpen(path2, &opt);
+    CHECK(mp2 != NULL && (uintptr_t) mp2 > (uintptr_t) mp + 4 * MB);
+    CHECK(MemoryPoolDestroy(mp2) == 0);
+    unlink(path2);
+
+    // 指定地址: 被占用或没有对齐时创建失败
+    opt.map_addr = (void*) (MP_FILE_BASE + 4 * GB);
+    CHECK((mp2 = MemoryPoolOpen(path2, &opt)) != NULL);
+    CHECK((uintptr_t) mp2 >= (uintptr_t) opt.map_addr && (uintptr_t) mp2 < (uintptr_t) opt.map_addr + MB);
+    CHECK(MemoryPoolDestroy(mp2) == 0);
+    unlink(path2);
+    opt.map_addr = (void*) ((uintptr_t) mp & ~(uintptr_t) (MB - 1));
+    CHECK(MemoryPoolOpen(path2, &opt) == NULL);
+    opt.map_addr = (void*) (MP_FILE_BASE + 4 * GB + 4096);
+    CHECK(MemoryPoolOpen(path2, &opt) == NULL);
+    unlink(path2);
+
+    PNode* head = NULL;
+    for (int i = 0; i < 100; i++) {
+        PNode* n = (PNode*) MemoryPoolAlloc(mp, sizeof(PNode) + i);
+        CHECK(n != NULL);
+        n->val = i;
+        n->next = head;
+        head = n;
+    }
+    CHECK(MemoryPoolSetRoot(mp, head) == 0);
+    CHECK(MemoryPoolDestroy(mp) == 0);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", "test.out", "reopen", path, (char*) NULL);
+        _exit(127);
+    }
+    int status = 0;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    CHECK((mp = MemoryPoolOpen(path, NULL)) != NULL);
+    head = (PNode*) MemoryPoolGetRoot(mp);
+    CHECK(list_length(head) == 120 && head->val == 219);
+    check_stats(mp);
+    CHECK(MemoryPoolDestroy(mp) == 0);
+    unlink(path);
+}
+
+void run_checks() {
+    check_size_bins();
+    check_buddy();
+    check_thread_cache();
+    check_aligned(MP_POLICY_FIRST_FIT);
+    check_aligned(MP_POLICY_BEST_FIT);
+    check_aligned(MP_POLICY_BUDDY);
+    check_realloc(MP_POLICY_FIRST_FIT);
+    check_realloc(MP_POLICY_BEST_FIT);
+    check_realloc(MP_POLICY_BUDDY);
+    check_calloc(MP_POLICY_FIRST_FIT);
+    check_calloc(MP_POLICY_BEST_FIT);
+    check_calloc(MP_POLICY_BUDDY);
+    check_trim();
+    check_lazy_commit(MP_POLICY_FIRST_FIT);
+    check_lazy_commit(MP_POLICY_BEST_FIT);
+    check_chunk_header();
+    check_region_rewind();
+    check_counters();
+    check_best_fit();
+    check_cpp_adapter();
+    check_large();
+    check_defer_merge();
+#ifdef _Z_MEMORYPOOL_THREAD_
+    check_remote_free();
+    check_arenas();
+    check_preload();
+#endif
+    check_huge_block();
+    check_min_align();
+    check_alloc_batch();
+    check_cache_free();
+    check_persistent(MP_POLICY_FIRST_FIT);
+    check_persistent(MP_POLICY_BEST_FIT);
+    check_persistent(MP_POLICY_BUDDY);
+    check_persistent_exec();
+}
+#endif
+
 #ifdef _Z_MEMORYPOOL_H_  // 全局变量记录内存池使用信息
 mem_size_t total_size = 0, cur_size = 0;
 #else
@@ -151,7 +1366,14 @@ void* test_fn(void* arg) {
     return NULL;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+#ifdef _Z_MEMORYPOOL_H_
+    // 由功能检查重新执行时只做对应的检查
+    if (argc > 2 && !strcmp(argv[1], "reopen")) return reopen_child(argv[2]);
+#ifdef _Z_MEMORYPOOL_THREAD_
+    if (argc > 1 && !strcmp(argv[1], "preload")) return preload_child();
+#endif
+#endif
     srand((unsigned) time(NULL));
     clock_t start, finish;
     double total_time;
@@ -160,8 +1382,18 @@ int main() {
 #ifndef _Z_MEMORYPOOL_H_  // 区分系统malloc和内存池实现
     printf("System malloc:\n");
 #else
+    run_checks();
     printf("Memory Pool:\n");
+#ifdef _Z_MEMORYPOOL_THREAD_
+    // 多线程时每个线程使用单独的分片
+    MemoryPoolOptions opt = {};
+    opt.max_mempool_size = MAX_MEM_SIZE;
+    opt.mempool_size = MEM_SIZE;
+    opt.arenas = 3;
+    MemoryPool* mp = MemoryPoolInitEx(&opt);
+#else
     MemoryPool* mp = MemoryPoolInit(MAX_MEM_SIZE, MEM_SIZE);
+#endif
 #endif
 
     pthread_attr_t attr;